@@ -0,0 +1,509 @@
+// Benchmarks for pep.h, over a synthetic corpus generated right here (so
+// every run measures the same pixels, with nothing to download).
+//
+//	cc -O2 -o pep_bench bench/pep_bench.c && ./pep_bench [table] [runs]
+//
+// Build it again with -DPEP_RECIPROCAL_DIVISION to compare the reciprocal
+// division against the hardware one, or with -DPEP_NO_SIMD to compare the
+// scalar decoder against the SSE2 one, the banner says which build it is.
+//
+// Tables:
+//	codec   encode and decode time of 256x256 pixel-art and noise images,
+//	        and the decode throughput
+//	sprites per-call encode and decode time of small 2-16 color sprites,
+//	        next to what clearing the whole model every call would add
+//	model   size of the model and of its arena, the cache-lines its live
+//	        contexts touch, and the hardware cache misses of a decode (Linux
+//	        perf, when allowed; where it isn't, as in most VMs, run the table
+//	        under valgrind --tool=cachegrind for simulated misses instead)
+//	radix   size and byte-symbol decode time of three ways to pack the
+//	        indices of 5-128 color images into bytes (see PEP_INDEX_RADIX)
+
+#define PEP_IMPLEMENTATION
+#include "../pep.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+	#include <linux/perf_event.h>
+	#include <sys/ioctl.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+#endif
+
+static uint32_t pep_bench_state = 1;
+
+static uint32_t pep_bench_random( void )
+{
+	pep_bench_state ^= pep_bench_state << 13;
+	pep_bench_state ^= pep_bench_state >> 17;
+	pep_bench_state ^= pep_bench_state << 5;
+	return pep_bench_state;
+}
+
+static uint32_t pep_bench_color( const uint32_t i )
+{
+	return ( ( i * 2654435761u ) & 0x00ffffff ) | 0xff000000;
+}
+
+static double pep_bench_now( void )
+{
+	struct timespec time;
+	clock_gettime( CLOCK_MONOTONIC, &time );
+	return ( double )time.tv_sec + ( double )time.tv_nsec * 1e-9;
+}
+
+// Rectangles of colors over a background, like pixel art. Every color is
+// used at least once.
+static uint32_t* pep_bench_art( const uint32_t width, const uint32_t height, const uint32_t colors, const uint32_t seed )
+{
+	pep_bench_state = seed * 7919 + 1;
+	uint32_t* const pixels = ( uint32_t* )malloc( ( size_t )width * height * sizeof( uint32_t ) );
+	for( uint32_t i = 0; i < width * height; i++ ) pixels[ i ] = pep_bench_color( 0 );
+
+	const uint32_t shapes = ( width * height ) / 40 + 3;
+	for( uint32_t s = 0; s < shapes; s++ )
+	{
+		const uint32_t color = pep_bench_color( pep_bench_random() % colors );
+		const uint32_t x0 = pep_bench_random() % width;
+		const uint32_t y0 = pep_bench_random() % height;
+		const uint32_t w = 1 + pep_bench_random() % 8;
+		const uint32_t h = 1 + pep_bench_random() % 8;
+		for( uint32_t y = y0; y < y0 + h && y < height; y++ )
+		{
+			for( uint32_t x = x0; x < x0 + w && x < width; x++ ) pixels[ y * width + x ] = color;
+		}
+	}
+	for( uint32_t c = 0; c < colors && c < width * height; c++ ) pixels[ ( c * 7919 ) % ( width * height ) ] = pep_bench_color( c );
+	return pixels;
+}
+
+// Every pixel a random color, the worst case for the model.
+static uint32_t* pep_bench_noise( const uint32_t width, const uint32_t height, const uint32_t colors, const uint32_t seed )
+{
+	pep_bench_state = seed * 31 + 7;
+	uint32_t* const pixels = ( uint32_t* )malloc( ( size_t )width * height * sizeof( uint32_t ) );
+	for( uint32_t i = 0; i < width * height; i++ ) pixels[ i ] = pep_bench_color( pep_bench_random() % colors );
+	for( uint32_t c = 0; c < colors && c < width * height; c++ ) pixels[ c ] = pep_bench_color( c );
+	return pixels;
+}
+
+typedef struct
+{
+	const char* name;
+	uint8_t noise;
+	uint16_t colors;
+}
+pep_bench_image;
+
+static const pep_bench_image pep_bench_images[] =
+{
+	{ "art c2", 0, 2 }, { "art c4", 0, 4 }, { "art c16", 0, 16 }, { "art c256", 0, 256 },
+	{ "noise c4", 1, 4 }, { "noise c16", 1, 16 }, { "noise c200", 1, 200 }, { "noise c256", 1, 256 },
+};
+
+#define PEP_BENCH_IMAGES ( sizeof( pep_bench_images ) / sizeof( pep_bench_images[ 0 ] ) )
+
+static uint32_t* pep_bench_pixels( const pep_bench_image* const image, const uint32_t width, const uint32_t height, const uint32_t seed )
+{
+	return image->noise ? pep_bench_noise( width, height, image->colors, seed ) : pep_bench_art( width, height, image->colors, seed );
+}
+
+static void pep_bench_banner( void )
+{
+	printf( "pep %s, reciprocal division %s, SSE2 %s\n\n", PEP_VERSION,
+		#ifdef PEP_RECIPROCAL_DIVISION
+			"on",
+		#else
+			"off",
+		#endif
+		#ifdef PEP_SSE2
+			"on"
+		#else
+			"off"
+		#endif
+	);
+}
+
+// Best-of-runs encode and decode time per image.
+static void pep_bench_codec( const uint32_t runs )
+{
+	printf( "256x256, best of %u runs\n", runs );
+	printf( "  %-12s %9s %10s %10s %10s\n", "image", "bytes", "encode ms", "decode ms", "Mpixels/s" );
+	for( uint32_t i = 0; i < PEP_BENCH_IMAGES; i++ )
+	{
+		uint32_t* const pixels = pep_bench_pixels( &pep_bench_images[ i ], 256, 256, i + 1 );
+		double encode = 1e9;
+		double decode = 1e9;
+		uint64_t bytes = 0;
+		for( uint32_t r = 0; r < runs; r++ )
+		{
+			const double t0 = pep_bench_now();
+			pep compressed = pep_compress( pixels, 256, 256, pep_rgba, pep_8bit );
+			const double t1 = pep_bench_now();
+			uint32_t* const decoded = pep_decompress( &compressed, pep_rgba, 0, 0 );
+			const double t2 = pep_bench_now();
+
+			if( decoded == NULL || memcmp( decoded, pixels, 256 * 256 * 4 ) != 0 )
+			{
+				printf( "  %s doesn't round-trip\n", pep_bench_images[ i ].name );
+				exit( 1 );
+			}
+			bytes = compressed.bytes_size;
+			if( t1 - t0 < encode ) encode = t1 - t0;
+			if( t2 - t1 < decode ) decode = t2 - t1;
+			free( decoded );
+			pep_free( &compressed );
+		}
+		printf( "  %-12s %9llu %10.3f %10.3f %10.1f\n", pep_bench_images[ i ].name, ( unsigned long long )bytes, encode * 1e3, decode * 1e3, 256 * 256 / decode * 1e-6 );
+		free( pixels );
+	}
+	printf( "\n" );
+}
+
+// The size of the model back when every context was a dense 257-entry
+// table, for comparison.
+#define PEP_BENCH_DENSE_MODEL_BYTES ( ( PEP_CONTEXTS_MAX + 1 ) * ( sizeof( uint16_t ) * PEP_FREQ_N + sizeof( uint32_t ) ) )
+
+// Per-call time over 512 sprites of each size, where fixed per-call costs
+// (like setting up the model) show up. The last column is one memset of
+// the dense model, which is what every call paid before the contexts were
+// cleared lazily.
+static void pep_bench_sprites( const uint32_t runs )
+{
+	static const uint32_t sizes[] = { 8, 16, 32, 64 };
+	const uint32_t count = 512;
+
+	printf( "512 sprites of 2-16 colors, best of %u runs, us per call\n", runs );
+	printf( "  %-8s %10s %10s %14s\n", "size", "encode", "decode", "model memset" );
+	for( uint32_t s = 0; s < sizeof( sizes ) / sizeof( sizes[ 0 ] ); s++ )
+	{
+		const uint32_t size = sizes[ s ];
+		uint32_t** const sprites = ( uint32_t** )malloc( count * sizeof( uint32_t* ) );
+		pep* const compressed = ( pep* )malloc( count * sizeof( pep ) );
+		for( uint32_t i = 0; i < count; i++ )
+		{
+			sprites[ i ] = pep_bench_art( size, size, 2 + i % 15, i + 1 );
+		}
+
+		double encode = 1e9;
+		double decode = 1e9;
+		double clear = 1e9;
+		uint8_t* const model = ( uint8_t* )malloc( PEP_BENCH_DENSE_MODEL_BYTES );
+		for( uint32_t r = 0; r < runs; r++ )
+		{
+			const double t0 = pep_bench_now();
+			for( uint32_t i = 0; i < count; i++ ) compressed[ i ] = pep_compress( sprites[ i ], ( uint16_t )size, ( uint16_t )size, pep_rgba, pep_8bit );
+			const double t1 = pep_bench_now();
+			for( uint32_t i = 0; i < count; i++ ) PEP_FREE( pep_decompress( &compressed[ i ], pep_rgba, 0, 0 ) );
+			const double t2 = pep_bench_now();
+			for( uint32_t i = 0; i < count; i++ )
+			{
+				memset( model, ( int )i, PEP_BENCH_DENSE_MODEL_BYTES );
+				pep_bench_state += model[ i ];
+			}
+			const double t3 = pep_bench_now();
+
+			for( uint32_t i = 0; i < count; i++ ) pep_free( &compressed[ i ] );
+			if( t1 - t0 < encode ) encode = t1 - t0;
+			if( t2 - t1 < decode ) decode = t2 - t1;
+			if( t3 - t2 < clear ) clear = t3 - t2;
+		}
+
+		char name[ 16 ];
+		snprintf( name, sizeof( name ), "%ux%u", size, size );
+		printf( "  %-8s %10.2f %10.2f %14.2f\n", name, encode * 1e6 / count, decode * 1e6 / count, clear * 1e6 / count );
+		for( uint32_t i = 0; i < count; i++ ) free( sprites[ i ] );
+		free( sprites );
+		free( compressed );
+		free( model );
+	}
+	printf( "\n" );
+}
+
+// Opens a counter of the hardware cache misses of this thread, or returns -1
+// where there is none (not Linux, no PMU in a VM, perf_event_paranoid).
+static int pep_bench_misses_open( void )
+{
+	#ifdef __linux__
+		struct perf_event_attr attr;
+		memset( &attr, 0, sizeof( attr ) );
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof( attr );
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		return ( int )syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+	#else
+		return -1;
+	#endif
+}
+
+static void pep_bench_misses_start( const int counter )
+{
+	#ifdef __linux__
+		if( counter < 0 ) return;
+		ioctl( counter, PERF_EVENT_IOC_RESET, 0 );
+		ioctl( counter, PERF_EVENT_IOC_ENABLE, 0 );
+	#else
+		( void )counter;
+	#endif
+}
+
+static uint64_t pep_bench_misses_stop( const int counter )
+{
+	uint64_t misses = 0;
+	#ifdef __linux__
+		if( counter < 0 ) return 0;
+		ioctl( counter, PERF_EVENT_IOC_DISABLE, 0 );
+		if( read( counter, &misses, sizeof( misses ) ) != sizeof( misses ) ) misses = 0;
+	#else
+		( void )counter;
+	#endif
+	return misses;
+}
+
+// The 64-byte lines a range of bytes touches.
+static uint32_t pep_bench_lines( const void* const start, const size_t size )
+{
+	if( size == 0 ) return 0;
+	const uintptr_t first = ( uintptr_t )start / 64;
+	const uintptr_t last = ( ( uintptr_t )start + size - 1 ) / 64;
+	return ( uint32_t )( last - first + 1 );
+}
+
+// The 64-byte lines a context touches: its header, its live frequencies,
+// and its live symbols (which sit after room for capacity frequencies).
+static uint32_t pep_bench_context_lines( const _pep_context* const context )
+{
+	uint32_t lines = pep_bench_lines( context, sizeof( _pep_context ) );
+	lines += pep_bench_lines( context->freq, context->count * sizeof( uint16_t ) );
+	lines += pep_bench_lines( context->symbols, context->count );
+	if( context->count > 0 && ( uintptr_t )&context->freq[ context->count - 1 ] / 64 == ( uintptr_t )context->symbols / 64 ) lines--;
+	return lines;
+}
+
+// What the model costs in memory: the struct, the arena its order-1
+// contexts live in, and what one 256x256 image actually touches of them.
+// Before the sparse contexts every context was a dense 257-entry table
+// (518 bytes, 9 lines), which every scan walked in full. The miss column is
+// per decode, over all the runs.
+static void pep_bench_model( const uint32_t runs )
+{
+	_pep_model model;
+	_pep_model_init( &model );
+	const int counter = pep_bench_misses_open();
+
+	printf( "sizeof( _pep_context ) = %u, sizeof( _pep_model ) = %u bytes (dense: %u)\n",
+		( uint32_t )sizeof( _pep_context ), ( uint32_t )sizeof( _pep_model ), ( uint32_t )PEP_BENCH_DENSE_MODEL_BYTES );
+	printf( "256x256, working set after encoding, cache misses per decode\n" );
+	printf( "  %-12s %8s %8s %10s %10s %10s %12s\n", "image", "contexts", "lines", "touched KB", "arena KB", "dense KB", "cache misses" );
+	for( uint32_t i = 0; i < PEP_BENCH_IMAGES; i++ )
+	{
+		uint32_t* const pixels = pep_bench_pixels( &pep_bench_images[ i ], 256, 256, i + 1 );
+		pep compressed = pep_compress( pixels, 256, 256, pep_rgba, pep_8bit );
+
+		_pep_model_reset( &model );
+		uint8_t* bytes = NULL;
+		size_t capacity = 0;
+		size_t size = 0;
+		_pep_encode_pixels( pixels, 256 * 256, compressed.palette, compressed.palette_size ? compressed.palette_size : 256, &model, NULL, &bytes, &capacity, &size );
+		PEP_FREE( bytes );
+
+		uint32_t contexts = 1;
+		uint32_t lines = pep_bench_context_lines( &model.contexts[ PEP_CONTEXTS_MAX ] );
+		for( uint32_t id = 0; id < PEP_CONTEXTS_MAX; id++ )
+		{
+			if( model.stamps[ id ] != model.generation || model.contexts[ id ].count == 0 ) continue;
+			contexts++;
+			lines += pep_bench_context_lines( &model.contexts[ id ] );
+		}
+
+		uint64_t misses = 0;
+		for( uint32_t r = 0; r < runs; r++ )
+		{
+			pep_bench_misses_start( counter );
+			uint32_t* const decoded = pep_decompress( &compressed, pep_rgba, 0, 0 );
+			misses += pep_bench_misses_stop( counter );
+			free( decoded );
+		}
+
+		char missed[ 24 ];
+		if( counter < 0 ) snprintf( missed, sizeof( missed ), "n/a" );
+		else snprintf( missed, sizeof( missed ), "%llu", ( unsigned long long )( misses / runs ) );
+		printf( "  %-12s %8u %8u %10.1f %10.1f %10.1f %12s\n", pep_bench_images[ i ].name, contexts, lines, lines * 64 / 1024.0, model.arena_used / 1024.0, contexts * 9 * 64 / 1024.0, missed );
+		pep_free( &compressed );
+		free( pixels );
+	}
+	#ifdef __linux__
+		if( counter >= 0 ) close( counter );
+	#endif
+	_pep_model_free( &model );
+	printf( "\n" );
+}
+
+// The ways palette indices can be packed into the byte-symbols the model
+// codes: as base-N digits with N rounded up to a power of two (what pep.h
+// does), as base-N digits with N the exact palette size, or as a plain
+// bit-stream where an index can straddle two bytes.
+typedef enum
+{
+	pep_bench_pack_pow2,
+	pep_bench_pack_exact,
+	pep_bench_pack_bits
+}
+pep_bench_pack;
+
+// Packs indices into out_symbols, and returns how many symbols it made.
+static uint32_t pep_bench_pack_indices( const uint8_t* const indices, const uint32_t count, const uint16_t colors, const pep_bench_pack pack, uint8_t* const out_symbols )
+{
+	uint32_t symbols = 0;
+	if( pack == pep_bench_pack_bits )
+	{
+		const uint32_t bits = PEP_BITS_TO_FIT( colors );
+		uint32_t buffer = 0;
+		uint32_t buffered = 0;
+		for( uint32_t i = 0; i < count; i++ )
+		{
+			buffer |= ( uint32_t )indices[ i ] << buffered;
+			buffered += bits;
+			while( buffered >= 8 )
+			{
+				out_symbols[ symbols++ ] = ( uint8_t )buffer;
+				buffer >>= 8;
+				buffered -= 8;
+			}
+		}
+		if( buffered > 0 ) out_symbols[ symbols++ ] = ( uint8_t )buffer;
+		return symbols;
+	}
+
+	const uint32_t radix = ( pack == pep_bench_pack_pow2 ) ? ( uint32_t )PEP_INDEX_RADIX( colors ) : colors;
+	uint32_t per_symbol = 1;
+	uint32_t span = radix;
+	while( span * radix <= 256 )
+	{
+		span *= radix;
+		per_symbol++;
+	}
+	for( uint32_t i = 0; i < count; i += per_symbol )
+	{
+		uint32_t symbol = 0;
+		uint32_t place = 1;
+		for( uint32_t d = 0; d < per_symbol && i + d < count; d++, place *= radix ) symbol += indices[ i + d ] * place;
+		out_symbols[ symbols++ ] = ( uint8_t )symbol;
+	}
+	return symbols;
+}
+
+// Codes symbols with the same order-1 model pep.h uses, as the indices of a
+// 256 color image (so every packing goes through the exact same coder),
+// and returns the compressed size, and the best decode time in decode.
+static uint64_t pep_bench_code_symbols( const uint8_t* const symbols, const uint32_t count, const uint32_t runs, double* const decode )
+{
+	// ( padded to whole 256 pixel rows with the last symbol, a few bytes at most )
+	const uint32_t height = ( count + 255 ) / 256;
+	uint32_t* const pixels = ( uint32_t* )malloc( ( size_t )height * 256 * sizeof( uint32_t ) );
+	pep coded;
+	memset( &coded, 0, sizeof( coded ) );
+	for( uint32_t i = 0; i < 256; i++ ) coded.palette[ i ] = pep_bench_color( i );
+	for( uint32_t i = 0; i < height * 256; i++ ) pixels[ i ] = coded.palette[ symbols[ ( i < count ) ? i : count - 1 ] ];
+
+	_pep_model model;
+	_pep_model_init( &model );
+	_pep_model_reset( &model );
+	size_t capacity = 0;
+	size_t size = 0;
+	_pep_encode_pixels( pixels, ( uint64_t )height * 256, coded.palette, 256, &model, NULL, &coded.bytes, &capacity, &size );
+	_pep_model_free( &model );
+	coded.bytes_size = size;
+	coded.width = 256;
+	coded.height = ( uint16_t )height;
+	coded.format = pep_rgba;
+	coded.channel_bits = pep_8bit;
+
+	*decode = 1e9;
+	for( uint32_t r = 0; r < runs; r++ )
+	{
+		const double t0 = pep_bench_now();
+		uint32_t* const decoded = pep_decompress( &coded, pep_rgba, 0, 0 );
+		const double t1 = pep_bench_now();
+		if( decoded == NULL || memcmp( decoded, pixels, ( size_t )height * 256 * sizeof( uint32_t ) ) != 0 )
+		{
+			printf( "  packed symbols don't round-trip\n" );
+			exit( 1 );
+		}
+		if( t1 - t0 < *decode ) *decode = t1 - t0;
+		free( decoded );
+	}
+	pep_free( &coded );
+	free( pixels );
+	return size;
+}
+
+// The three packings over images whose index width wastes bits when packed
+// by powers of two: 3 bits (5-8 colors, 2 indices per byte), and 5, 6 and 7
+// bits (17-128 colors, 1 index per byte). The pep column is pep_compress()
+// itself, which tunes the model to the real palette size, so it comes out
+// a little smaller than pow2 on the same symbols. Decode times are of the byte-symbols alone, unpacking the
+// indices back out of them is the same handful of operations for all three.
+static void pep_bench_radix( const uint32_t runs )
+{
+	static const uint16_t colors[] = { 5, 8, 17, 32, 33, 64, 65, 128 };
+
+	printf( "256x256, bytes, and byte-symbol decode ms (best of %u runs)\n", runs );
+	printf( "  %-12s %5s %8s %8s %8s %8s %7s %7s %7s\n", "image", "bits", "pep", "pow2", "exact", "bits", "pow2", "exact", "bits" );
+	uint8_t* const indices = ( uint8_t* )malloc( 256 * 256 );
+	uint8_t* const symbols = ( uint8_t* )malloc( 256 * 256 );
+	for( uint32_t noise = 0; noise < 2; noise++ )
+	{
+		for( uint32_t c = 0; c < sizeof( colors ) / sizeof( colors[ 0 ] ); c++ )
+		{
+			const pep_bench_image image = { NULL, ( uint8_t )noise, colors[ c ] };
+			uint32_t* const pixels = pep_bench_pixels( &image, 256, 256, c + 1 );
+			for( uint32_t i = 0; i < 256 * 256; i++ )
+			{
+				uint8_t index = 0;
+				while( pep_bench_color( index ) != pixels[ i ] ) index++;
+				indices[ i ] = index;
+			}
+
+			pep compressed = pep_compress( pixels, 256, 256, pep_rgba, pep_8bit );
+			uint64_t bytes[ 3 ];
+			double decode[ 3 ];
+			for( uint32_t pack = 0; pack < 3; pack++ )
+			{
+				const uint32_t count = pep_bench_pack_indices( indices, 256 * 256, colors[ c ], ( pep_bench_pack )pack, symbols );
+				bytes[ pack ] = pep_bench_code_symbols( symbols, count, runs, &decode[ pack ] );
+			}
+
+			char name[ 16 ];
+			snprintf( name, sizeof( name ), "%s c%u", noise ? "noise" : "art", colors[ c ] );
+			printf( "  %-12s %5u %8llu %8llu %8llu %8llu %7.3f %7.3f %7.3f\n", name, ( uint32_t )PEP_BITS_TO_FIT( colors[ c ] ), ( unsigned long long )compressed.bytes_size,
+				( unsigned long long )bytes[ 0 ], ( unsigned long long )bytes[ 1 ], ( unsigned long long )bytes[ 2 ], decode[ 0 ] * 1e3, decode[ 1 ] * 1e3, decode[ 2 ] * 1e3 );
+			pep_free( &compressed );
+			free( pixels );
+		}
+	}
+	free( indices );
+	free( symbols );
+	printf( "\n" );
+}
+
+int main( int argc, char** argv )
+{
+	const char* const table = ( argc > 1 ) ? argv[ 1 ] : "all";
+	const uint32_t runs = ( argc > 2 ) ? ( uint32_t )atoi( argv[ 2 ] ) : 20;
+	const uint8_t all = strcmp( table, "all" ) == 0;
+
+	pep_bench_banner();
+	if( all || strcmp( table, "codec" ) == 0 ) pep_bench_codec( runs ? runs : 1 );
+	if( all || strcmp( table, "sprites" ) == 0 ) pep_bench_sprites( runs ? runs : 1 );
+	if( all || strcmp( table, "model" ) == 0 ) pep_bench_model( runs ? runs : 1 );
+	if( all || strcmp( table, "radix" ) == 0 ) pep_bench_radix( runs ? runs : 1 );
+	return 0;
+}
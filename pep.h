@@ -52,13 +52,26 @@
 // which is often for low-level/backend rendering pipelines.
 // Windows only supports ARGB for example, and so sometimes it's easier to
 // make the whole application use that format.
+//
+// The formats after pep_argb are only for pep_decompress_into(), for targets
+// that don't use 32bit pixels. 16bit formats are native-endian uint16_t with
+// the first-named channel in the top bits, 24bit formats are bytes in the
+// named order, and pep_l8 is the Rec.601 luminance.
 typedef enum
 {
 	pep_rgba,
 	pep_bgra,
 
 	pep_abgr,
-	pep_argb
+	pep_argb,
+
+	pep_rgb565,
+	pep_rgba5551,
+	pep_rgba4444,
+	pep_rgb24,
+	pep_bgr24,
+	pep_l8,
+	pep_a8
 }
 pep_format;
 
@@ -87,11 +100,112 @@ typedef struct
 	uint16_t height;
 	pep_format format;
 	uint32_t palette[ 256 ];
-	uint8_t palette_size;
+	uint8_t palette_size; // 0 means all 256 colors are used
 	pep_channel_bits channel_bits;
 }
 pep;
 
+// What pep_peek_info() reads from the first few bytes of a serialized pep.
+typedef struct
+{
+	uint16_t width;
+	uint16_t height;
+	pep_format format;
+	pep_channel_bits channel_bits;
+	uint16_t palette_count; // 1-256
+	uint64_t bytes_size; // of the compressed pixels
+	uint32_t palette_offset; // where the serialized palette starts
+	uint32_t data_offset; // where the compressed pixels start, the whole pep is data_offset + bytes_size
+}
+pep_info;
+
+// A serialized pep's header (everything before the palette) is never longer
+// than this, so it's all pep_peek_info() needs.
+#define PEP_HEADER_MAX_BYTES 16
+
+// The header plus the largest palette (256 RGBA colors).
+#define PEP_HEAD_MAX_BYTES ( PEP_HEADER_MAX_BYTES + 256 * 4 )
+
+// Orientation flags for pep_decompress_into(), the rotation is applied first,
+// so all 8 orientations are a combination of these.
+typedef enum
+{
+	pep_flip_x = 1,
+	pep_flip_y = 2,
+	pep_rotate_90 = 4 // clockwise
+}
+pep_orientation;
+
+// How many rows pep_decompress_into() decodes at once when rotating.
+#define PEP_ROTATE_TILE 16
+
+// Describes the pixels pep_decompress_into() writes to.
+typedef struct
+{
+	void* pixels;
+	uint32_t stride; // bytes per row, 0 means tightly packed rows
+	pep_format format;
+	uint8_t transparent_first_color;
+	uint8_t pre_multiply;
+	uint8_t upscale; // each pixel becomes an N*N block, 0 or 1 means no upscaling
+	uint8_t orientation; // pep_orientation flags
+	const uint32_t* palette; // replaces in_pep->palette (in in_pep->format), NULL to keep it
+	const uint8_t* remap; // 256 entries, index i gets color remap[ i ], NULL for none
+}
+pep_target;
+
+// Frames that share one palette and size, coded back to back with a model
+// that stays warm from one frame to the next (see pep_compress_animation()).
+typedef struct
+{
+	pep image; // the shared palette and size, bytes holds every frame
+	uint64_t* frame_offsets; // frame_count + 1 offsets into image.bytes
+	uint32_t frame_count;
+	uint32_t keyframe_interval; // the model restarts every N frames, 0 means only on frame 0
+	uint8_t delta; // frames between keyframes only code what changed (see pep_compress_animation_delta())
+}
+pep_animation;
+
+// A pack is "PEPK", the asset count and the shared palette count, an index
+// of PEP_PACK_ENTRY_BYTES entries sorted by name hash, an offset to each
+// shared palette, the shared palettes (each with its prior, if any), and
+// then every asset, as a serialized pep or, when it uses a shared palette,
+// only its compressed pixels.
+#define PEP_PACK_HEADER_BYTES 12
+#define PEP_PACK_ENTRY_BYTES 36
+
+// The palette_id of an asset that keeps its own palette.
+#define PEP_PACK_OWN_PALETTE 0xffff
+
+// A palette that many of a pack's assets can share (see pep_pack_build()).
+// An asset whose colors are all in it is stored without any palette or
+// header. With prior set, those assets are also coded from a model trained
+// on all of them, instead of from a flat one.
+typedef struct
+{
+	uint32_t colors[ 256 ];
+	uint16_t count; // 1-256
+	pep_format format; // only assets in the same format can use it
+	uint8_t prior;
+}
+pep_pack_palette;
+
+// One asset in a pack's index (see pep_pack_find()).
+typedef struct
+{
+	uint64_t hash; // pep_pack_hash() of its name
+	uint64_t offset; // where it starts in the pack
+	uint64_t size; // in bytes
+	uint16_t width;
+	uint16_t height;
+	uint16_t palette_count; // 1-256
+	uint8_t format;
+	uint8_t channel_bits;
+	uint16_t palette_id; // which shared palette it uses, or PEP_PACK_OWN_PALETTE
+	uint8_t prior; // it was coded from its shared palette's prior
+}
+pep_pack_entry;
+
 // This is the amount of frequencies per context, and the amount of contexts,
 // with [256] being the order0 context.
 // Originally there were 256*256 contexts, but I found the image didn't get
@@ -109,21 +223,87 @@ pep;
 #define PEP_PROB_MAX_VALUE ( 1 << PEP_FREQ_MAX_BITS )
 #define PEP_CODE_MAX_VALUE ( ( 1 << PEP_CODE_BITS ) - 1 )
 
+// The arithmetic-coder divides its range by the frequency-sum of a context
+// for every symbol. Define PEP_RECIPROCAL_DIVISION to replace that hardware
+// division with a multiply-shift from a table of precomputed magic numbers
+// (Granlund-Montgomery "round-up" method), which is exact for all 32bit
+// ranges, so files stay bit-identical. The sums never get much bigger than
+// PEP_PROB_MAX_VALUE, larger divisors just fall back to plain division.
+/*
+#define PEP_RECIPROCAL_DIVISION
+*/
+#define PEP_RECIPROCAL_N ( PEP_PROB_MAX_VALUE + 1024 )
+
 // During the compression process the context per frequency-group needs to be
 // tracked, with the sum of all frequencies being stored.
+// Most contexts only ever see a handful of the 256 symbols, so instead of a
+// dense table only the live symbols are stored, sorted, with the escape
+// frequency kept apart. They live in a block of the model's arena with room
+// for capacity of them, which starts at PEP_CONTEXT_MIN_CAPACITY and
+// doubles as the context fills up, so a context takes 3 bytes per live
+// symbol instead of the 514 of a dense table.
 typedef struct
 {
-	uint16_t freq[ PEP_FREQ_N ];
+	uint16_t* freq;
+	uint8_t* symbols;
 	uint32_t sum;
+	uint16_t count;
+	uint16_t escape;
+	uint16_t capacity;
 }
 _pep_context;
 
+#define PEP_CONTEXT_MIN_CAPACITY 4
+
 // PEP_FREQ_MAX is the maximum accumulative frequency.
 // This is the starting maximum, and is scaled as the image compresses, via
 // the palette-delta; which seems to roughly correlate with the complexity.
 // This value works better for low-res images.
 #define PEP_FREQ_MAX ( PEP_FREQ_END >> 1 )
 
+// The adaptive state of the PPM coder: every order-1 context, plus order0.
+// The struct is ~10KB (the dense contexts took ~133KB), and the symbols of
+// the order-1 contexts are packed one after the other in arena, which only
+// grows as big as the live ones need (a 16 color sprite's are a few KB).
+// order0 always holds every symbol, so it keeps its own arrays.
+// Clearing all the contexts costs more than coding a small sprite, so
+// contexts are cleared lazily: each one carries the generation it was last
+// cleared in, and resetting the model only bumps the generation and empties
+// the arena. A model starts with _pep_model_init() (or zeroed), and
+// _pep_model_free() frees its arena.
+// When the arena can't grow the model is marked failed (the coder goes on,
+// the symbol just stays escaped), and the caller has to check for that.
+typedef struct
+{
+	_pep_context contexts[ PEP_CONTEXTS_MAX + 1 ];
+	uint32_t stamps[ PEP_CONTEXTS_MAX ];
+	uint32_t generation;
+	uint16_t freq_max;
+	uint8_t failed;
+	uint8_t* arena;
+	uint32_t arena_size;
+	uint32_t arena_used;
+	uint16_t order0_freq[ PEP_FREQ_END ];
+	uint8_t order0_symbols[ PEP_FREQ_END ];
+}
+_pep_model;
+
+// The arena never needs to be bigger than every order-1 context full, and
+// gets a few bytes of slack for the SSE2 search, which can read a few
+// frequencies past the last live one.
+#define PEP_ARENA_MIN_BYTES 4096
+#define PEP_ARENA_MAX_BYTES ( PEP_CONTEXTS_MAX * PEP_FREQ_END * 3 )
+#define PEP_ARENA_SLACK_BYTES 16
+
+// A prior is a model's state stored compactly, so another model can start
+// from it instead of from scratch (see pep_pack_palette): freq_max, how
+// many contexts follow, and each live one as its id (PEP_CONTEXTS_MAX for
+// order0), count, escape, symbols and frequencies. Each context is scaled
+// down to a sum of at most PEP_PRIOR_SUM_MAX first, so an image coded from
+// it still adapts quickly to its own colors.
+#define PEP_PRIOR_SUM_MAX 1024
+#define PEP_PRIOR_MAX_BYTES ( 4 + ( PEP_CONTEXTS_MAX + 1 ) * ( 6 + 3 * PEP_FREQ_END ) )
+
 // Arithmetic coding structures:
 typedef struct
 {
@@ -155,6 +335,7 @@ typedef struct
 {
 	_pep_prob prob;
 	uint32_t symbol;
+	uint32_t position;
 }
 _pep_sym_decode;
 
@@ -162,29 +343,130 @@ _pep_sym_decode;
 // This increments the symbol's frequency and the total sum.
 // When we hit freq_max, we increase the freq_max via a complexity
 // approximation via the palette-size, then we scale everything down
-// to a quarter to keep the frequencies manageable.
+// by half to keep the frequencies manageable (see _pep_context_rescale()).
 // This dynamic part helps the compression adapt to the image's patterns.
-#define PEP_UPDATE( CONTEXT, SYMBOL, FREQ_MAX, PALETTE_SIZE )\
+#define PEP_UPDATE( CONTEXT, POSITION, FREQ_MAX, PALETTE_SIZE )\
 	do\
 	{\
-		CONTEXT->freq[ SYMBOL ] += 2;\
+		CONTEXT->freq[ POSITION ] += 2;\
 		CONTEXT->sum += 2;\
-		if( CONTEXT->freq[ SYMBOL ] >= FREQ_MAX || CONTEXT->sum >= PEP_PROB_MAX_VALUE )\
+		if( CONTEXT->freq[ POSITION ] >= FREQ_MAX || CONTEXT->sum >= PEP_PROB_MAX_VALUE )\
 		{\
 			FREQ_MAX += ( PEP_FREQ_END - PALETTE_SIZE ) >> 1;\
-			CONTEXT->sum = 0;\
-			for( uint64_t f = 0; f < PEP_FREQ_N; f++ )\
-			{\
-				const uint16_t _f = CONTEXT->freq[ f ];\
-				if( _f == 0 ) continue;\
-				const uint16_t scaled = ( _f + 1 ) >> 1;\
-				CONTEXT->freq[ f ] = scaled;\
-				CONTEXT->sum += scaled;\
-			}\
+			_pep_context_rescale( CONTEXT );\
 		}\
 	}\
 	while( 0 )
 
+// Flat areas repeat the same symbol in the same context over and over.
+// Incrementing a symbol's frequency doesn't move its cumulative low, so as
+// long as that context isn't rescaled or given a new symbol, the low of the
+// last coded symbol can be reused instead of re-scanning the frequencies.
+// This keeps the output bit-exact, it only skips work.
+typedef struct
+{
+	const _pep_context* context;
+	uint32_t symbol;
+	uint32_t position;
+	uint32_t low;
+}
+_pep_run;
+
+// Remember the symbol that was just coded, unless PEP_UPDATE rescaled the
+// context (the sum didn't simply grow by 2), which moves every low.
+#define PEP_RUN_TRACK( RUN, CONTEXT, SYMBOL, POSITION, LOW, SUM_BEFORE )\
+	do\
+	{\
+		RUN.context = ( CONTEXT->sum == ( SUM_BEFORE ) + 2 ) ? CONTEXT : NULL;\
+		RUN.symbol = SYMBOL;\
+		RUN.position = POSITION;\
+		RUN.low = LOW;\
+	}\
+	while( 0 )
+
+// Everything the decoder carries from one byte-symbol to the next.
+typedef struct
+{
+	_pep_ac_decode ac;
+	_pep_model* model;
+	_pep_run run;
+	uint32_t context_id;
+	uint16_t palette_count;
+	uint8_t indices_per_byte;
+	// only for _pep_decode_indices(), the rest of a partially used symbol
+	const uint8_t ( *unpacked )[ 8 ];
+	const uint8_t* pending;
+	uint8_t pending_count;
+}
+_pep_decoder;
+
+// Where decoded rows end up, for pep_decompress_into()/pep_decompress_onto().
+// Runs of indices are placed in output pixels (after orientation, before
+// upscaling) and clipped to the surface in upscaled pixels.
+typedef struct
+{
+	uint8_t* pixels;
+	size_t stride;
+	int64_t left, top; // where the image's top-left pixel lands on the surface
+	uint32_t width, height; // of the surface
+	uint8_t bytes_per_pixel;
+	uint8_t scale;
+	int16_t key; // palette index that is never written, or -1
+	uint8_t palette[ 256 ][ 4 ];
+}
+_pep_canvas;
+
+// Decodes a pep_animation's frames in order (see pep_animation_play()).
+typedef struct
+{
+	const pep_animation* animation;
+	_pep_model* model;
+	uint32_t frame; // the one pep_animation_next() decodes
+	uint8_t* indices; // the last frame's palette indices, only for delta animations
+	uint8_t* column; // a rotated column of them
+	uint8_t write_all; // the target doesn't hold the last frame yet
+}
+pep_animation_player;
+
+// Records frames one at a time into a delta pep_animation (see pep_stream_begin()).
+typedef struct
+{
+	pep_animation animation; // everything recorded so far, usable at any time
+	_pep_model* model;
+	uint32_t* previous; // the last frame
+	uint32_t* region_pixels;
+	uint8_t* context_symbols;
+	size_t bytes_capacity;
+	uint32_t frames_capacity;
+	uint16_t palette_count; // reserved up front, the animation's palette_size
+	uint16_t palette_used; // the ones that hold a color so far
+}
+pep_stream;
+
+// A pack that's open for lookups (see pep_pack_open() and pep_pack_map()).
+typedef struct
+{
+	const uint8_t* bytes; // the whole pack
+	uint64_t size;
+	uint32_t count; // of assets
+	uint32_t palettes; // how many shared palettes there are
+	uint8_t mapped; // 1 when pep_pack_map() mapped the file, 2 when it read it
+	_pep_model* models; // the loaded prior and a copy to decode with, allocated by the first asset that needs one
+	uint16_t prior_palette; // whose prior models[ 0 ] holds, valid while models isn't NULL
+}
+pep_pack;
+
+// How pep_pack_build() stores one asset.
+typedef struct
+{
+	uint8_t* bytes; // its pixels coded with a shared palette, NULL when it keeps its own
+	uint64_t size; // of bytes, or of its serialized pep
+	uint64_t offset;
+	uint16_t palette_id;
+	uint8_t prior; // coded from its shared palette's prior
+}
+_pep_pack_asset;
+
 // This defines a set of macros that serve as wrappers for the standard
 // C library memory management functions: `malloc`, `realloc`, and `free`.
 // These macros can be used to easily replace the underlying memory allocation
@@ -207,29 +489,168 @@ _pep_sym_decode;
 	#endif
 #endif
 
+// Provides a cross-platform macro to count trailing zeros in a 32-bit integer.
+#ifndef PEP_COUNT_TRAILING_ZEROS
+	#ifdef _MSC_VER
+		// Microsoft Visual C++ compiler.
+		#define PEP_COUNT_TRAILING_ZEROS( x ) _tzcnt_u32( x )
+	#else
+		// GCC/Clang compilers.
+		#define PEP_COUNT_TRAILING_ZEROS( x ) __builtin_ctz( x )
+	#endif
+#endif
+
+// The decoder's cumulative-frequency search uses SSE2 where it's available.
+// Every x86-64 CPU has it, so it's picked at compile-time without any
+// runtime CPU detection. Define PEP_NO_SIMD to always use the scalar loops.
+// SSE2 is the only vector path: there is no AVX2 one (a context's few live
+// symbols rarely fill more than 8 lanes), and ARM builds, NEON or not, get
+// the scalar loops.
+#if !defined( PEP_NO_SIMD ) && ( defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 ) )
+	#define PEP_SSE2
+#endif
+
+// pep_pack_map() maps the pack file with mmap() where it exists, so opening
+// it costs no reads, and only the pages that get used are ever loaded.
+// Define PEP_NO_MMAP to read the whole file instead.
+#if !defined( PEP_NO_MMAP ) && ( defined( __unix__ ) || defined( __APPLE__ ) )
+	#define PEP_MMAP
+#endif
+
+// pep_save() hands the header and the compressed pixels to writev() where
+// it exists, so the pixels are never copied into a temporary buffer.
+// Define PEP_NO_WRITEV to always save through stdio.
+#if !defined( PEP_NO_WRITEV ) && ( defined( __unix__ ) || defined( __APPLE__ ) )
+	#define PEP_WRITEV
+#endif
+
 // How many bits do we need to fit N values?
 #define PEP_BITS_TO_FIT( N )( ( ( N ) <= 1 ) ? 1 : ( 32 - PEP_COUNT_LEADING_ZEROS( ( N ) - 1 ) ) )
 
+// Palette indices are packed into byte-symbols as base-N digits.
+// N is the palette size rounded up to a power of two, so this is plain
+// bit-packing. An exact radix (e.g. 3 colors -> 5 indices per byte instead
+// of 4) wastes fewer bits, but with the order-1 model it compressed worse
+// on 5 of the 6 measured cases (up to 7.8%, only 3-color noise was 2.2%
+// smaller) and decoded up to 2.4x slower: the symbols spread over a far
+// bigger alphabet, which the contexts learn slower and scan further.
+// Past 16 colors an exact radix packs the same one index per byte anyway.
+// A bit-stream (indices straddling bytes, no bit wasted) was 0.4-24% bigger
+// for 5-128 colors in the bench's radix table (only 128-color noise was 1%
+// smaller) and decoded up to 1.8x slower: a byte no longer lines up with
+// the pixels, so the order-1 contexts have nothing steady to learn.
+#define PEP_INDEX_RADIX( PALETTE_COUNT ) ( 1 << PEP_BITS_TO_FIT( PALETTE_COUNT ) )
+
 ////////////////////////////////////////////////////////////////
 
-static inline _pep_prob _pep_get_prob_from_ctx( const _pep_context* const ctx, const uint32_t symbol );
+static inline uint8_t _pep_indices_per_byte( const uint16_t palette_count );
+static inline void _pep_model_restart( _pep_model* const model );
+static inline void _pep_model_reset( _pep_model* const model );
+static inline void _pep_model_init( _pep_model* const model );
+static inline void _pep_model_free( _pep_model* const model );
+static inline _pep_context* _pep_model_context( _pep_model* const model, const uint32_t id );
+static inline uint8_t _pep_model_grow( _pep_model* const model, const uint32_t bytes );
+static inline uint8_t _pep_context_reserve( _pep_model* const model, _pep_context* const ctx, const uint32_t capacity );
+static inline uint32_t _pep_model_save_prior( const _pep_model* const model, uint8_t* const out_bytes );
+static inline uint8_t _pep_model_clone( _pep_model* const model, const _pep_model* const from );
+static inline uint8_t _pep_model_load_prior( _pep_model* const model, const uint8_t* const in_bytes, const uint64_t in_bytes_size );
+static inline uint32_t _pep_context_find( const _pep_context* const ctx, const uint32_t symbol, uint32_t* const out_low );
+static inline void _pep_context_insert( _pep_model* const model, _pep_context* const ctx, const uint32_t symbol );
+static inline void _pep_context_rescale( _pep_context* const ctx );
+static inline _pep_prob _pep_get_prob_from_ctx( const _pep_context* const ctx, const uint32_t position );
+static inline _pep_prob _pep_get_escape_prob_from_ctx( const _pep_context* const ctx );
+static inline uint32_t _pep_divide_scale( const uint32_t range, const uint32_t scale );
 static inline void _pep_arith_encode( _pep_ac_encode* const ac, const _pep_prob prob );
 static inline void _pep_arith_encode_normalize( _pep_ac_encode* const ac );
 static inline uint32_t _pep_arith_decode_curr_freq( _pep_ac_decode* const ac, const uint32_t scale );
 static inline void _pep_arith_decode_update( _pep_ac_decode* const ac, const _pep_prob prob );
 static inline _pep_sym_decode _pep_get_sym_from_freq( const _pep_context* const ctx, const uint32_t target_freq );
+static inline void _pep_decoder_init( _pep_decoder* const decoder, const pep* const in_pep, _pep_model* const model, const uint8_t reset_model );
+static inline uint8_t _pep_decode_symbol( _pep_decoder* const decoder );
+static inline void _pep_decode_indices( _pep_decoder* const decoder, uint8_t* out_indices, uint32_t count );
+static inline void _pep_unpacked_indices( const uint16_t palette_count, uint8_t unpacked[ 256 ][ 8 ] );
+static inline void _pep_output_palette( const pep* const in_pep, const pep_format out_format, const uint8_t transparent_first_color, const uint8_t pre_multiply, const uint32_t* const palette, const uint8_t* const remap, uint8_t out_palette[ 256 ][ 4 ] );
+static inline void _pep_write_row( uint8_t* out, const uint8_t* const indices, const uint32_t count, const uint8_t palette[ 256 ][ 4 ], const uint8_t bytes_per_pixel, const uint8_t scale );
+static inline void _pep_write_clipped( uint8_t* out, const _pep_canvas* const canvas, const uint8_t* const indices, const uint32_t count, const uint8_t head, const uint8_t tail );
+static inline void _pep_canvas_run( const _pep_canvas* const canvas, const uint8_t* const indices, const uint32_t count, const uint32_t out_x, const uint32_t out_y );
+static inline uint8_t _pep_canvas_init( _pep_canvas* const canvas, const pep* const in_pep, const pep_target* const target, const uint32_t surface_width, const uint32_t surface_height, const int32_t x, const int32_t y, const int16_t key );
+static inline void _pep_canvas_region( const _pep_canvas* const canvas, const uint8_t* const indices, const uint32_t width, const uint32_t height, const uint32_t region[ 4 ], const uint8_t orientation, uint8_t* const column );
+static inline uint8_t _pep_decompress_canvas( const pep* const in_pep, const pep_target* const target, const uint32_t surface_width, const uint32_t surface_height, const int32_t x, const int32_t y, const int16_t key, _pep_model* const warm_model );
 
 static inline uint32_t _pep_pre_multiply( const uint32_t pixel, const pep_format format );
 static inline uint32_t _pep_reformat( const uint32_t in_color, const pep_format in_format, const pep_format out_format );
+static inline void _pep_radix_sort( uint32_t* const keys, uint32_t* const temp, const uint32_t count );
+static inline uint8_t _pep_box_widest_channel( const uint32_t* const colors, const uint32_t begin, const uint32_t end, uint8_t* const out_channel );
+static inline uint8_t _pep_nearest_color( const uint32_t color, int32_t channels[ 4 ][ 256 ], const uint16_t palette_count );
+static inline uint32_t* pep_quantize( const uint32_t* in_pixels, const uint16_t width, const uint16_t height, const pep_format in_format, const uint16_t max_colors, const uint8_t dither );
+static inline uint8_t _pep_build_palette( const uint32_t* const in_pixels, const uint64_t pixels_area, uint32_t palette[ 256 ], uint16_t* const io_palette_count );
+static inline uint8_t _pep_encode_pixels( const uint32_t* const in_pixels, const uint64_t pixels_area, const uint32_t palette[ 256 ], const uint16_t palette_count, _pep_model* const model, const uint8_t* context_symbols, uint8_t** const io_bytes, size_t* const io_capacity, size_t* const io_size );
 static inline pep pep_compress( const uint32_t* in_pixels, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_channel_bits in_channel_bits );
+static inline pep _pep_compress_palette( const uint32_t* in_pixels, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_channel_bits in_channel_bits, const uint32_t palette[ 256 ], const uint16_t palette_count );
+static inline pep pep_compress_quantized( const uint32_t* in_pixels, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_channel_bits in_channel_bits, const uint8_t dither );
 static inline uint32_t* pep_decompress( const pep* const in_pep, const pep_format out_format, const uint8_t first_color_transparent, uint8_t const pre_multiply );
+static inline uint32_t* pep_decompress_recolored( const pep* const in_pep, const pep_format out_format, const uint8_t transparent_first_color, uint8_t const pre_multiply, const uint32_t* const in_palette, const uint8_t* const remap );
+static inline uint8_t pep_decompress_into( const pep* const in_pep, const pep_target* const target );
+static inline uint8_t pep_decompress_onto( const pep* const in_pep, const pep_target* const target, const uint32_t target_width, const uint32_t target_height, const int32_t x, const int32_t y );
+static inline uint8_t pep_bytes_per_pixel( const pep_format format );
 static inline void pep_free( pep* in_pep );
 
+static inline uint8_t _pep_write_varint( uint8_t* const out_bytes, uint64_t value );
+static inline uint8_t _pep_read_varint( const uint8_t** const io_bytes, const uint8_t* const bytes_end, uint64_t* const out_value );
+static inline uint32_t _pep_serialize_head( const pep* const in_pep, uint8_t out_head[ PEP_HEAD_MAX_BYTES ] );
 static inline uint8_t* pep_serialize( const pep* in_pep, uint32_t* const out_size );
-static inline pep pep_deserialize( const uint8_t* const in_bytes, const uint32_t in_bytes_size );
+static inline size_t pep_serialized_size( const pep* const in_pep );
+static inline size_t pep_serialize_into( const pep* const in_pep, uint8_t* const out_bytes, const size_t out_capacity );
+static inline pep pep_deserialize( const uint8_t* const in_bytes, const uint64_t in_bytes_size );
+static inline pep pep_deserialize_view( const uint8_t* const in_bytes, const uint64_t in_bytes_size );
+static inline uint8_t pep_peek_info( const uint8_t* const in_bytes, const uint64_t in_bytes_size, pep_info* const out_info );
 
 static inline uint8_t pep_save( const pep* const in_pep, const char* const file_path );
 static inline pep pep_load( const char* const file_path );
+static inline uint8_t pep_peek_info_file( const char* const file_path, pep_info* const out_info );
+
+static inline uint8_t _pep_is_keyframe( const pep_animation* const in_animation, const uint32_t frame );
+static inline pep _pep_animation_frame( const pep_animation* const in_animation, const uint32_t frame );
+static inline void _pep_changed_region( const uint32_t* const previous, const uint32_t* const current, const uint32_t width, const uint32_t height, uint32_t out_region[ 4 ] );
+static inline void _pep_copy_region( const uint32_t* const in_pixels, const uint32_t width, const uint32_t region[ 4 ], uint32_t* out_pixels );
+static inline void _pep_pack_symbols( const uint32_t* const in_pixels, const uint64_t pixels_area, const uint32_t palette[ 256 ], const uint16_t palette_count, uint8_t* out_symbols );
+static inline uint8_t _pep_encode_changes( const uint32_t* const previous, const uint32_t* const current, const uint32_t width, const uint32_t region[ 4 ], const uint32_t palette[ 256 ], const uint16_t palette_count, _pep_model* const model, uint32_t* const region_pixels, uint8_t* const context_symbols, uint8_t** const io_bytes, size_t* const io_capacity, size_t* const io_size );
+static inline uint8_t _pep_animation_decode_delta( pep_animation_player* const player, uint32_t out_region[ 4 ] );
+static inline pep_animation _pep_compress_animation( const uint32_t* const* in_frames, const uint32_t frame_count, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_channel_bits in_channel_bits, const uint32_t keyframe_interval, const uint8_t delta );
+static inline pep_animation pep_compress_animation( const uint32_t* const* in_frames, const uint32_t frame_count, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_channel_bits in_channel_bits, const uint32_t keyframe_interval );
+static inline pep_animation pep_compress_animation_delta( const uint32_t* const* in_frames, const uint32_t frame_count, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_channel_bits in_channel_bits, const uint32_t keyframe_interval );
+static inline void pep_free_animation( pep_animation* in_animation );
+static inline uint8_t pep_animation_play( const pep_animation* const in_animation, pep_animation_player* const out_player );
+static inline uint8_t pep_animation_next( pep_animation_player* const player, const pep_target* const target );
+static inline uint8_t pep_animation_seek( pep_animation_player* const player, const uint32_t frame );
+static inline void pep_animation_stop( pep_animation_player* const player );
+static inline uint8_t* pep_serialize_animation( const pep_animation* const in_animation, uint64_t* const out_size );
+static inline pep_animation pep_deserialize_animation( const uint8_t* const in_bytes, const uint64_t in_bytes_size );
+static inline uint8_t pep_save_animation( const pep_animation* const in_animation, const char* const file_path );
+static inline pep_animation pep_load_animation( const char* const file_path );
+
+static inline void _pep_stream_free_buffers( pep_stream* const stream );
+static inline uint8_t pep_stream_begin( pep_stream* const out_stream, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_channel_bits in_channel_bits, const uint16_t max_colors, const uint32_t keyframe_interval );
+static inline uint8_t pep_stream_push( pep_stream* const stream, const uint32_t* const in_pixels );
+static inline pep_animation pep_stream_end( pep_stream* const stream );
+
+static inline void _pep_put_be( uint8_t* const out_bytes, const uint64_t value, const uint8_t bytes );
+static inline uint64_t _pep_get_be( const uint8_t* const in_bytes, const uint8_t bytes );
+static inline int _pep_pack_compare( const void* a, const void* b );
+static inline uint64_t pep_pack_hash( const char* const name );
+static inline uint16_t _pep_pack_palette_of( const pep* const in_pep, const pep_pack_palette* const palettes, const uint16_t palettes_count );
+static inline uint8_t _pep_pack_encode_shared( const pep* const in_pep, const pep_pack_palette* const palette, _pep_model* const model, uint8_t** const io_bytes, size_t* const io_capacity, size_t* const io_size );
+static inline uint8_t _pep_pack_share( const pep* const peps, const uint32_t count, const pep_pack_palette* const palettes, const uint16_t palettes_count, _pep_model* const model, _pep_pack_asset* const assets, uint8_t** const priors, uint32_t* const prior_sizes );
+static inline uint8_t* pep_pack_build( const char* const* names, const pep* const peps, const uint32_t count, const pep_pack_palette* const palettes, const uint16_t palettes_count, uint64_t* const out_size );
+static inline uint8_t pep_save_pack( const char* const* names, const pep* const peps, const uint32_t count, const pep_pack_palette* const palettes, const uint16_t palettes_count, const char* const file_path );
+static inline uint8_t pep_pack_open( pep_pack* const out_pack, const uint8_t* const in_bytes, const uint64_t in_bytes_size );
+static inline uint8_t pep_pack_map( pep_pack* const out_pack, const char* const file_path );
+static inline void pep_pack_close( pep_pack* const pack );
+static inline uint8_t pep_pack_find_hash( const pep_pack* const pack, const uint64_t hash, pep_pack_entry* const out_entry );
+static inline uint8_t pep_pack_find( const pep_pack* const pack, const char* const name, pep_pack_entry* const out_entry );
+static inline pep _pep_pack_view( const pep_pack* const pack, const pep_pack_entry* const entry, const uint8_t** const out_prior, uint32_t* const out_prior_size );
+static inline pep pep_pack_view( const pep_pack* const pack, const pep_pack_entry* const entry, uint8_t* const out_needs_prior );
+static inline uint8_t pep_pack_decompress_into( pep_pack* const pack, const pep_pack_entry* const entry, const pep_target* const target );
 
 ////////////////////////////////////////////////////////////////
 
@@ -244,26 +665,464 @@ static inline pep pep_load( const char* const file_path );
 	#pragma warning( disable : 4996 )
 #endif
 
+#ifdef PEP_SSE2
+	#include <emmintrin.h> // SSE2
+#endif
+
+#ifdef PEP_WRITEV
+	#include <fcntl.h> // open
+	#include <sys/uio.h> // writev
+	#include <unistd.h> // close
+	#include <errno.h> // EINTR
+#endif
+
+#ifdef PEP_MMAP
+	#include <fcntl.h> // open
+	#include <sys/mman.h> // mmap
+	#include <sys/stat.h> // fstat
+	#include <unistd.h> // close
+#endif
+
+// How many base-radix palette indices fit into one byte-symbol.
+static inline uint8_t _pep_indices_per_byte( const uint16_t palette_count )
+{
+	const uint16_t radix = PEP_INDEX_RADIX( palette_count );
+	uint8_t indices = 1;
+	uint16_t span = radix;
+	while( span * radix <= 256 )
+	{
+		span *= radix;
+		indices++;
+	}
+	return indices;
+}
+
+// Makes the model start from scratch: every context empty, order0 flat.
+// order0 holds all 256 byte-symbols, even the ones a small palette can
+// never produce (e.g. 3 colors only make 3^4 = 81 of them). Leaving those
+// out was measured at 0.1-0.7% smaller for 256x256 images, but every file
+// written before then would decode to wrong pixels, and the header has no
+// bit left to tell the two apart.
+static inline void _pep_model_reset( _pep_model* const model )
+{
+	_pep_model_restart( model );
+
+	_pep_context* const order0 = &model->contexts[ PEP_CONTEXTS_MAX ];
+	for( uint32_t i = 0; i < PEP_FREQ_END; i++ )
+	{
+		order0->freq[ i ] = 1;
+		order0->symbols[ i ] = ( uint8_t )i;
+	}
+	order0->count = PEP_FREQ_END;
+	order0->escape = 1;
+	order0->sum = PEP_FREQ_N;
+
+	model->freq_max = PEP_FREQ_MAX;
+}
+
+// Empties every order-1 context (lazily) and the arena, for
+// _pep_model_reset() and _pep_model_clone() to fill in order0.
+static inline void _pep_model_restart( _pep_model* const model )
+{
+	if( ++model->generation == 0 )
+	{
+		memset( model->stamps, 0, sizeof( model->stamps ) );
+		model->generation = 1;
+	}
+	model->arena_used = 0;
+	model->failed = 0;
+
+	_pep_context* const order0 = &model->contexts[ PEP_CONTEXTS_MAX ];
+	order0->freq = model->order0_freq;
+	order0->symbols = model->order0_symbols;
+	order0->capacity = PEP_FREQ_END;
+}
+
+// Same as zeroing the model, but without touching the contexts, which
+// every reset clears lazily anyway.
+static inline void _pep_model_init( _pep_model* const model )
+{
+	memset( model->stamps, 0, sizeof( model->stamps ) );
+	model->generation = 0;
+	model->freq_max = PEP_FREQ_MAX;
+	model->failed = 0;
+	model->arena = NULL;
+	model->arena_size = 0;
+	model->arena_used = 0;
+}
+
+static inline void _pep_model_free( _pep_model* const model )
+{
+	PEP_FREE( model->arena );
+	model->arena = NULL;
+	model->arena_size = 0;
+	model->arena_used = 0;
+}
+
+// Fetches an order-1 context, clearing it first if it wasn't touched since
+// the last _pep_model_reset().
+static inline _pep_context* _pep_model_context( _pep_model* const model, const uint32_t id )
+{
+	_pep_context* const context = &model->contexts[ id ];
+	if( model->stamps[ id ] != model->generation )
+	{
+		model->stamps[ id ] = model->generation;
+		context->freq = NULL;
+		context->symbols = NULL;
+		context->sum = 0;
+		context->count = 0;
+		context->escape = 0;
+		context->capacity = 0;
+	}
+	return context;
+}
+
+// Makes room for bytes more in the arena, by packing every live block into
+// a new one (which also drops the blocks contexts have grown out of).
+// Returns 0 when out of memory
+static inline uint8_t _pep_model_grow( _pep_model* const model, const uint32_t bytes )
+{
+	// ( an empty arena has no blocks to pack, the first grow skips the scans )
+	uint32_t live = bytes;
+	for( uint32_t id = 0; id < PEP_CONTEXTS_MAX && model->arena_used > 0; id++ )
+	{
+		if( model->stamps[ id ] == model->generation ) live += model->contexts[ id ].capacity * 3;
+	}
+
+	uint32_t size = live * 2;
+	if( size < PEP_ARENA_MIN_BYTES ) size = PEP_ARENA_MIN_BYTES;
+	if( size > PEP_ARENA_MAX_BYTES ) size = PEP_ARENA_MAX_BYTES;
+	if( size < live ) size = live;
+
+	uint8_t* const arena = ( uint8_t* )PEP_MALLOC( ( size_t )size + PEP_ARENA_SLACK_BYTES );
+	if( arena == NULL ) return 0;
+	memset( arena + size, 0, PEP_ARENA_SLACK_BYTES );
+
+	uint32_t used = 0;
+	for( uint32_t id = 0; id < PEP_CONTEXTS_MAX && model->arena_used > 0; id++ )
+	{
+		_pep_context* const context = &model->contexts[ id ];
+		if( model->stamps[ id ] != model->generation || context->capacity == 0 ) continue;
+
+		uint16_t* const freq = ( uint16_t* )( arena + used );
+		uint8_t* const symbols = arena + used + context->capacity * 2;
+		if( context->count > 0 )
+		{
+			memcpy( freq, context->freq, context->count * sizeof( uint16_t ) );
+			memcpy( symbols, context->symbols, context->count );
+		}
+		context->freq = freq;
+		context->symbols = symbols;
+		used += context->capacity * 3;
+	}
+
+	PEP_FREE( model->arena );
+	model->arena = arena;
+	model->arena_size = size;
+	model->arena_used = used;
+	return 1;
+}
+
+// Gives ctx room for at least capacity live symbols (at most 256), moving
+// it to a bigger block at the end of the arena when it has to.
+// Returns 0 when out of memory, which also marks the model failed
+static inline uint8_t _pep_context_reserve( _pep_model* const model, _pep_context* const ctx, const uint32_t capacity )
+{
+	if( ctx->capacity >= capacity ) return 1;
+
+	uint32_t grown = ctx->capacity ? ctx->capacity : PEP_CONTEXT_MIN_CAPACITY;
+	while( grown < capacity ) grown <<= 1;
+	if( grown > PEP_FREQ_END ) grown = PEP_FREQ_END;
+
+	const uint32_t bytes = grown * 3;
+	if( model->arena_size - model->arena_used < bytes && !_pep_model_grow( model, bytes ) )
+	{
+		model->failed = 1;
+		return 0;
+	}
+
+	uint16_t* const freq = ( uint16_t* )( model->arena + model->arena_used );
+	uint8_t* const symbols = model->arena + model->arena_used + grown * 2;
+	if( ctx->count > 0 )
+	{
+		memcpy( freq, ctx->freq, ctx->count * sizeof( uint16_t ) );
+		memcpy( symbols, ctx->symbols, ctx->count );
+	}
+	ctx->freq = freq;
+	ctx->symbols = symbols;
+	ctx->capacity = ( uint16_t )grown;
+	model->arena_used += bytes;
+	return 1;
+}
+
+// Stores the model's live contexts as a prior (see PEP_PRIOR_SUM_MAX) into
+// out_bytes, which has room for PEP_PRIOR_MAX_BYTES.
+// Returns the prior's size in bytes
+static inline uint32_t _pep_model_save_prior( const _pep_model* const model, uint8_t* const out_bytes )
+{
+	uint8_t* out_ref = out_bytes + 4;
+	uint16_t contexts = 0;
+	for( uint32_t id = 0; id <= PEP_CONTEXTS_MAX; id++ )
+	{
+		if( id < PEP_CONTEXTS_MAX && model->stamps[ id ] != model->generation ) continue;
+
+		// ( it's scaled down on a copy of the frequencies )
+		_pep_context context = model->contexts[ id ];
+		if( context.count == 0 ) continue;
+		uint16_t freq[ PEP_FREQ_END ];
+		memcpy( freq, context.freq, context.count * sizeof( uint16_t ) );
+		context.freq = freq;
+
+		// ( it stops when only the 1s are left )
+		uint32_t sum = 0;
+		while( context.sum > PEP_PRIOR_SUM_MAX && context.sum != sum )
+		{
+			sum = context.sum;
+			_pep_context_rescale( &context );
+		}
+
+		_pep_put_be( out_ref, id, 2 );
+		_pep_put_be( out_ref + 2, context.count, 2 );
+		_pep_put_be( out_ref + 4, context.escape, 2 );
+		out_ref += 6;
+		memcpy( out_ref, context.symbols, context.count );
+		out_ref += context.count;
+		for( uint16_t i = 0; i < context.count; i++, out_ref += 2 )
+		{
+			_pep_put_be( out_ref, context.freq[ i ], 2 );
+		}
+		contexts++;
+	}
+
+	_pep_put_be( out_bytes, model->freq_max, 2 );
+	_pep_put_be( out_bytes + 2, contexts, 2 );
+	return ( uint32_t )( out_ref - out_bytes );
+}
+
+// Makes model a copy of from, copying only from's live contexts.
+// Returns 0 when out of memory
+static inline uint8_t _pep_model_clone( _pep_model* const model, const _pep_model* const from )
+{
+	_pep_model_restart( model );
+
+	// ( the arena is sized for all of from's contexts at once )
+	if( model->arena_size < from->arena_used && !_pep_model_grow( model, from->arena_used ) ) return 0;
+
+	for( uint32_t id = 0; id <= PEP_CONTEXTS_MAX; id++ )
+	{
+		if( id < PEP_CONTEXTS_MAX && from->stamps[ id ] != from->generation ) continue;
+
+		const _pep_context* const source = &from->contexts[ id ];
+		_pep_context* const context = ( id == PEP_CONTEXTS_MAX ) ? &model->contexts[ PEP_CONTEXTS_MAX ] : _pep_model_context( model, id );
+		if( !_pep_context_reserve( model, context, source->count ) ) return 0;
+		context->sum = source->sum;
+		context->count = source->count;
+		context->escape = source->escape;
+		memcpy( context->freq, source->freq, source->count * sizeof( uint16_t ) );
+		memcpy( context->symbols, source->symbols, source->count );
+	}
+	model->freq_max = from->freq_max;
+	return 1;
+}
+
+// Resets the model, and then starts it from a prior instead of flat.
+// Returns 0 when the prior is corrupt
+static inline uint8_t _pep_model_load_prior( _pep_model* const model, const uint8_t* const in_bytes, const uint64_t in_bytes_size )
+{
+	_pep_model_reset( model );
+	if( in_bytes == NULL || in_bytes_size < 4 ) return 0;
+
+	const uint8_t* bytes_ref = in_bytes + 4;
+	const uint8_t* const bytes_end = in_bytes + in_bytes_size;
+	const uint16_t freq_max = ( uint16_t )_pep_get_be( in_bytes, 2 );
+	const uint16_t contexts = ( uint16_t )_pep_get_be( in_bytes + 2, 2 );
+	if( freq_max < PEP_FREQ_MAX ) return 0;
+
+	for( uint16_t c = 0; c < contexts; c++ )
+	{
+		if( bytes_end - bytes_ref < 6 ) return 0;
+		const uint16_t id = ( uint16_t )_pep_get_be( bytes_ref, 2 );
+		const uint16_t count = ( uint16_t )_pep_get_be( bytes_ref + 2, 2 );
+		const uint16_t escape = ( uint16_t )_pep_get_be( bytes_ref + 4, 2 );
+		bytes_ref += 6;
+		if( id > PEP_CONTEXTS_MAX || count == 0 || count > PEP_FREQ_END || escape == 0 ) return 0;
+		if( ( uint64_t )( bytes_end - bytes_ref ) < ( uint64_t )count * 3 ) return 0;
+
+		const uint8_t* const symbols = bytes_ref;
+		const uint8_t* const freqs = bytes_ref + count;
+		// ( order0 has to keep every symbol, any of them can come up )
+		if( id == PEP_CONTEXTS_MAX && count != PEP_FREQ_END ) return 0;
+		uint32_t sum = escape;
+		for( uint16_t i = 0; i < count; i++ )
+		{
+			const uint16_t freq = ( uint16_t )_pep_get_be( freqs + 2 * i, 2 );
+			if( freq == 0 || ( i > 0 && symbols[ i ] <= symbols[ i - 1 ] ) ) return 0;
+			sum += freq;
+		}
+		if( sum >= PEP_PROB_MAX_VALUE ) return 0;
+
+		_pep_context* const context = ( id == PEP_CONTEXTS_MAX ) ? &model->contexts[ PEP_CONTEXTS_MAX ] : _pep_model_context( model, id );
+		if( !_pep_context_reserve( model, context, count ) ) return 0;
+		context->sum = sum;
+		context->count = count;
+		context->escape = escape;
+		memcpy( context->symbols, symbols, count );
+		for( uint16_t i = 0; i < count; i++ )
+		{
+			context->freq[ i ] = ( uint16_t )_pep_get_be( freqs + 2 * i, 2 );
+		}
+		bytes_ref += ( size_t )count * 3;
+	}
+
+	model->freq_max = freq_max;
+	return bytes_ref == bytes_end;
+}
+
+// Finds where symbol is (or would be) in the sorted list of live symbols,
+// along with the cumulative frequency of everything before it.
+static inline uint32_t _pep_context_find( const _pep_context* const ctx, const uint32_t symbol, uint32_t* const out_low )
+{
+	uint32_t low = 0;
+	uint32_t position = 0;
+	while( position < ctx->count && ctx->symbols[ position ] < symbol )
+	{
+		low += ctx->freq[ position ];
+		position++;
+	}
+	*out_low = low;
+	return position;
+}
+
+// Makes a new symbol live in a context (with the lowest frequency), giving
+// a context that was still empty its escape frequency first.
+static inline void _pep_context_insert( _pep_model* const model, _pep_context* const ctx, const uint32_t symbol )
+{
+	uint32_t position = 0;
+	while( position < ctx->count && ctx->symbols[ position ] < symbol ) position++;
+	if( position < ctx->count && ctx->symbols[ position ] == symbol ) return;
+	if( !_pep_context_reserve( model, ctx, ctx->count + 1u ) ) return;
+
+	if( ctx->sum == 0 )
+	{
+		ctx->escape = 1;
+		ctx->sum = 1;
+	}
+
+	const uint32_t after = ctx->count - position;
+	memmove( &ctx->freq[ position + 1 ], &ctx->freq[ position ], after * sizeof( uint16_t ) );
+	memmove( &ctx->symbols[ position + 1 ], &ctx->symbols[ position ], after );
+	ctx->freq[ position ] = 1;
+	ctx->symbols[ position ] = ( uint8_t )symbol;
+	ctx->count++;
+	ctx->sum++;
+}
+
+// Halves every frequency, rounding up so nothing live drops to 0.
+static inline void _pep_context_rescale( _pep_context* const ctx )
+{
+	ctx->escape = ( ctx->escape + 1 ) >> 1;
+	uint32_t sum = ctx->escape;
+	uint32_t f = 0;
+
+	#ifdef PEP_SSE2
+		// ( the rounding average with 0 is exactly ( f + 1 ) >> 1 )
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i ones = _mm_set1_epi16( 1 );
+		__m128i sums = zero;
+		for( ; f + 8 <= ctx->count; f += 8 )
+		{
+			__m128i* const freq = ( __m128i* )&ctx->freq[ f ];
+			const __m128i scaled = _mm_avg_epu16( _mm_loadu_si128( freq ), zero );
+			_mm_storeu_si128( freq, scaled );
+			sums = _mm_add_epi32( sums, _mm_madd_epi16( scaled, ones ) );
+		}
+		sums = _mm_add_epi32( sums, _mm_shuffle_epi32( sums, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+		sums = _mm_add_epi32( sums, _mm_shuffle_epi32( sums, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+		sum += ( uint32_t )_mm_cvtsi128_si32( sums );
+	#endif
+
+	for( ; f < ctx->count; f++ )
+	{
+		const uint16_t scaled = ( ctx->freq[ f ] + 1 ) >> 1;
+		ctx->freq[ f ] = scaled;
+		sum += scaled;
+	}
+	ctx->sum = sum;
+}
+
 // Getting cumulative frequnce of symbol
-static inline _pep_prob _pep_get_prob_from_ctx( const _pep_context* const ctx, const uint32_t symbol )
+static inline _pep_prob _pep_get_prob_from_ctx( const _pep_context* const ctx, const uint32_t position )
 {
 	_pep_prob prob = { 0 };
 	prob.scale = ctx->sum;
 
-	for( uint32_t i = 0; i < symbol; ++i )
+	for( uint32_t i = 0; i < position; ++i )
 	{
 		prob.low += ctx->freq[ i ];
 	}
 
-	prob.high = prob.low + ctx->freq[ symbol ];
+	prob.high = prob.low + ctx->freq[ position ];
+	return prob;
+}
+
+// The escape symbol always sits after every live symbol.
+static inline _pep_prob _pep_get_escape_prob_from_ctx( const _pep_context* const ctx )
+{
+	_pep_prob prob;
+	prob.scale = ctx->sum;
+	prob.low = ctx->sum - ctx->escape;
+	prob.high = ctx->sum;
 	return prob;
 }
 
+#ifdef PEP_RECIPROCAL_DIVISION
+// The magic number of every divisor d from 1 to PEP_RECIPROCAL_N, at
+// [ d - 1 ], worked out by the compiler so nothing builds it at runtime.
+// A divisor's shift l is ceil( log2( d ) ), the bit-length of d - 1, so the
+// table is spelled out in aligned blocks of d - 1 that share one l.
+#define PEP_MAGIC( e, l ) ( uint32_t )( ( ( 1llu << 32 ) * ( ( 1llu << ( l ) ) - ( ( e ) + 1 ) ) ) / ( ( e ) + 1 ) + 1 ),
+#define PEP_MAGIC_4( e, l ) PEP_MAGIC( e, l ) PEP_MAGIC( ( e ) + 1, l ) PEP_MAGIC( ( e ) + 2, l ) PEP_MAGIC( ( e ) + 3, l )
+#define PEP_MAGIC_16( e, l ) PEP_MAGIC_4( e, l ) PEP_MAGIC_4( ( e ) + 4, l ) PEP_MAGIC_4( ( e ) + 8, l ) PEP_MAGIC_4( ( e ) + 12, l )
+#define PEP_MAGIC_64( e, l ) PEP_MAGIC_16( e, l ) PEP_MAGIC_16( ( e ) + 16, l ) PEP_MAGIC_16( ( e ) + 32, l ) PEP_MAGIC_16( ( e ) + 48, l )
+#define PEP_MAGIC_256( e, l ) PEP_MAGIC_64( e, l ) PEP_MAGIC_64( ( e ) + 64, l ) PEP_MAGIC_64( ( e ) + 128, l ) PEP_MAGIC_64( ( e ) + 192, l )
+#define PEP_MAGIC_1024( e, l ) PEP_MAGIC_256( e, l ) PEP_MAGIC_256( ( e ) + 256, l ) PEP_MAGIC_256( ( e ) + 512, l ) PEP_MAGIC_256( ( e ) + 768, l )
+
+static const uint32_t _pep_reciprocal_magic[ PEP_RECIPROCAL_N ] =
+{
+	PEP_MAGIC( 0, 0 ) PEP_MAGIC( 1, 1 ) PEP_MAGIC( 2, 2 ) PEP_MAGIC( 3, 2 )
+	PEP_MAGIC_4( 4, 3 ) PEP_MAGIC_4( 8, 4 ) PEP_MAGIC_4( 12, 4 )
+	PEP_MAGIC_16( 16, 5 ) PEP_MAGIC_16( 32, 6 ) PEP_MAGIC_16( 48, 6 )
+	PEP_MAGIC_64( 64, 7 ) PEP_MAGIC_64( 128, 8 ) PEP_MAGIC_64( 192, 8 )
+	PEP_MAGIC_256( 256, 9 ) PEP_MAGIC_256( 512, 10 ) PEP_MAGIC_256( 768, 10 )
+	PEP_MAGIC_1024( 1024, 11 ) PEP_MAGIC_1024( 2048, 12 ) PEP_MAGIC_1024( 3072, 12 )
+	PEP_MAGIC_1024( 4096, 13 ) PEP_MAGIC_1024( 5120, 13 ) PEP_MAGIC_1024( 6144, 13 ) PEP_MAGIC_1024( 7168, 13 )
+	PEP_MAGIC_1024( 8192, 14 ) PEP_MAGIC_1024( 9216, 14 ) PEP_MAGIC_1024( 10240, 14 ) PEP_MAGIC_1024( 11264, 14 )
+	PEP_MAGIC_1024( 12288, 14 ) PEP_MAGIC_1024( 13312, 14 ) PEP_MAGIC_1024( 14336, 14 ) PEP_MAGIC_1024( 15360, 14 )
+	PEP_MAGIC_1024( 16384, 15 )
+};
+#endif
+
+// range / scale, where scale is a frequency-sum.
+static inline uint32_t _pep_divide_scale( const uint32_t range, const uint32_t scale )
+{
+	#ifdef PEP_RECIPROCAL_DIVISION
+		if( scale - 1 < PEP_RECIPROCAL_N )
+		{
+			if( scale == 1 ) return range;
+			const uint32_t t = ( uint32_t )( ( ( uint64_t )range * _pep_reciprocal_magic[ scale - 1 ] ) >> 32 );
+			const uint8_t l = ( uint8_t )( 32 - PEP_COUNT_LEADING_ZEROS( scale - 1 ) );
+			return ( t + ( ( range - t ) >> 1 ) ) >> ( l - 1 );
+		}
+	#endif
+
+	return range / scale;
+}
+
 // This encodes a symbol into the arithmetic-coding range. It scales the
 // current range based on the symbol's frequency and total frequency count.
 static inline void _pep_arith_encode( _pep_ac_encode* const ac, const _pep_prob prob )
 {
-	ac->range /= prob.scale;
+	ac->range = _pep_divide_scale( ac->range, prob.scale );
 	ac->low += prob.low * ac->range;
 	ac->range *= prob.high - prob.low;
 }
@@ -292,7 +1151,9 @@ static inline void _pep_arith_encode_normalize( _pep_ac_encode* const ac )
 // Getting current frequency by doing reverse trasformation
 static inline uint32_t _pep_arith_decode_curr_freq( _pep_ac_decode* const ac, const uint32_t scale )
 {
-	ac->range /= scale;
+	ac->range = _pep_divide_scale( ac->range, scale );
+	// ( only corrupt data gets a scale past the range )
+	ac->range += ( ac->range == 0 );
 	uint32_t result = ( ac->code - ac->low ) / ( ac->range );
 	return result;
 }
@@ -328,46 +1189,325 @@ static inline void _pep_arith_decode_update( _pep_ac_decode* const ac, const _pe
 
 static inline _pep_sym_decode _pep_get_sym_from_freq( const _pep_context* const ctx, const uint32_t target_freq )
 {
-	_pep_sym_decode result = { };
+	_pep_sym_decode result = { 0 };
 
-	uint32_t s = 0;
+	uint32_t position = ctx->count;
 	uint32_t freq = 0;
-	for( ; s <= PEP_FREQ_END; ++s )
+	// ( past the live symbols it can only be the escape )
+	if( target_freq < ctx->sum - ctx->escape )
 	{
-		freq += ctx->freq[ s ];
-		if( freq > target_freq ) break;
+		#ifdef PEP_SSE2
+			// Prefix-sums 8 frequencies at a time, and finds the first one
+			// past the target. The sums stay below PEP_PROB_MAX_VALUE + 512,
+			// so signed 16bit compares are fine. The last load can read a
+			// few lanes past the live symbols (still inside the context),
+			// but the target is always found before them.
+			const __m128i target = _mm_set1_epi16( ( short )target_freq );
+			__m128i carry = _mm_setzero_si128();
+			for( position = 0; ; position += 8 )
+			{
+				__m128i sums = _mm_loadu_si128( ( const __m128i* )&ctx->freq[ position ] );
+				sums = _mm_add_epi16( sums, _mm_slli_si128( sums, 2 ) );
+				sums = _mm_add_epi16( sums, _mm_slli_si128( sums, 4 ) );
+				sums = _mm_add_epi16( sums, _mm_slli_si128( sums, 8 ) );
+				sums = _mm_add_epi16( sums, carry );
+
+				const uint32_t found = ( uint32_t )_mm_movemask_epi8( _mm_cmpgt_epi16( sums, target ) );
+				if( found != 0 )
+				{
+					uint16_t lanes[ 8 ];
+					_mm_storeu_si128( ( __m128i* )lanes, sums );
+					const uint32_t lane = PEP_COUNT_TRAILING_ZEROS( found ) >> 1;
+					position += lane;
+					freq = lanes[ lane ];
+					break;
+				}
+
+				carry = _mm_shufflehi_epi16( sums, 0xff );
+				carry = _mm_unpackhi_epi64( carry, carry );
+			}
+		#else
+			for( position = 0; ; ++position )
+			{
+				freq += ctx->freq[ position ];
+				if( freq > target_freq ) break;
+			}
+		#endif
 	}
-	if( s > PEP_FREQ_END ) s = PEP_FREQ_END;
 
-	result.prob.high = freq;
-	result.prob.low = freq - ctx->freq[ s ];
+	if( position < ctx->count )
+	{
+		result.prob.high = freq;
+		result.prob.low = freq - ctx->freq[ position ];
+		result.symbol = ctx->symbols[ position ];
+	}
+	else
+	{
+		result.prob.high = ctx->sum;
+		result.prob.low = ctx->sum - ctx->escape;
+		result.symbol = PEP_FREQ_END;
+	}
 	result.prob.scale = ctx->sum;
-	result.symbol = s;
+	result.position = position;
 
 	return result;
 }
 
-// pep supports pre-multiplying the RGB channels with the A channel.
-static inline uint32_t _pep_pre_multiply( const uint32_t pixel, const pep_format format )
+// Resets the model for in_pep and starts reading its bytes.
+static inline void _pep_decoder_init( _pep_decoder* const decoder, const pep* const in_pep, _pep_model* const model, const uint8_t reset_model )
 {
-	uint8_t* bytes = ( uint8_t* )( &pixel );
+	memset( decoder, 0, sizeof( _pep_decoder ) );
+	decoder->model = model;
+	decoder->palette_count = in_pep->palette_size ? in_pep->palette_size : 256;
+	decoder->indices_per_byte = _pep_indices_per_byte( decoder->palette_count );
+	if( reset_model ) _pep_model_reset( model );
 
-	if( format <= pep_bgra )
-	{
-		uint32_t scaled_a = ( uint32_t )( bytes[ 3 ] ) * 257;
-		bytes[ 1 ] = ( uint8_t )( ( ( uint32_t )( bytes[ 1 ] ) * scaled_a + 32896 ) >> 16 );
-		bytes[ 2 ] = ( uint8_t )( ( ( uint32_t )( bytes[ 2 ] ) * scaled_a + 32896 ) >> 16 );
-		bytes[ 3 ] = ( uint8_t )( ( ( uint32_t )( bytes[ 3 ] ) * scaled_a + 32896 ) >> 16 );
-	}
-	else
+	decoder->ac.range = ( uint32_t )( ( 1llu << 32 ) - 1 );
+	decoder->ac.data_ref = in_pep->bytes;
+	decoder->ac.end_of_data = in_pep->bytes + in_pep->bytes_size;
+
+	for( uint8_t i = 0; i < 4; ++i )
 	{
-		uint32_t scaled_a = ( uint32_t )( bytes[ 0 ] ) * 257;
-		bytes[ 0 ] = ( uint8_t )( ( ( uint32_t )( bytes[ 0 ] ) * scaled_a + 32896 ) >> 16 );
-		bytes[ 1 ] = ( uint8_t )( ( ( uint32_t )( bytes[ 1 ] ) * scaled_a + 32896 ) >> 16 );
-		bytes[ 2 ] = ( uint8_t )( ( ( uint32_t )( bytes[ 2 ] ) * scaled_a + 32896 ) >> 16 );
-	}
+		uint8_t in_byte = 0;
+		if( decoder->ac.data_ref != decoder->ac.end_of_data )
+		{
+			in_byte = *decoder->ac.data_ref++;
+		}
 
-	return pixel;
+		decoder->ac.code = ( decoder->ac.code << 8 ) | in_byte;
+	}
+}
+
+// Decodes the next byte-symbol (one or more packed palette indices).
+static inline uint8_t _pep_decode_symbol( _pep_decoder* const decoder )
+{
+	_pep_model* const model = decoder->model;
+	_pep_context* const order0 = &model->contexts[ PEP_CONTEXTS_MAX ];
+	_pep_context* const context_ref = _pep_model_context( model, decoder->context_id % PEP_CONTEXTS_MAX );
+	const uint32_t context_sum = context_ref->sum;
+	_pep_sym_decode decode_result;
+
+	uint8_t symbol_found = 0;
+	if( context_sum != 0 )
+	{
+		uint32_t decode_freq = _pep_arith_decode_curr_freq( &decoder->ac, context_sum );
+		// ( unsigned wrap-around also rejects decode_freq < run.low )
+		if( decoder->run.context == context_ref && decode_freq - decoder->run.low < context_ref->freq[ decoder->run.position ] )
+		{
+			decode_result.symbol = decoder->run.symbol;
+			decode_result.position = decoder->run.position;
+			decode_result.prob.low = decoder->run.low;
+			decode_result.prob.high = decoder->run.low + context_ref->freq[ decoder->run.position ];
+			decode_result.prob.scale = context_sum;
+		}
+		else
+		{
+			decode_result = _pep_get_sym_from_freq( context_ref, decode_freq );
+		}
+		_pep_arith_decode_update( &decoder->ac, decode_result.prob );
+
+		if( decode_result.symbol != PEP_FREQ_END )
+		{
+			symbol_found = 1;
+			PEP_UPDATE( context_ref, decode_result.position, model->freq_max, decoder->palette_count );
+			PEP_RUN_TRACK( decoder->run, context_ref, decode_result.symbol, decode_result.position, decode_result.prob.low, context_sum );
+		}
+		else
+		{
+			decoder->run.context = NULL;
+			context_ref->escape++;
+			context_ref->sum++;
+			// ( a sum can only grow past this by escaping symbols that are
+			// already live, which corrupt data can do forever )
+			if( context_ref->sum > PEP_PROB_MAX_VALUE + 2 * PEP_FREQ_END ) _pep_context_rescale( context_ref );
+		}
+	}
+
+	if( !symbol_found )
+	{
+		decoder->run.context = NULL;
+		uint32_t decode_freq = _pep_arith_decode_curr_freq( &decoder->ac, order0->sum );
+		decode_result = _pep_get_sym_from_freq( order0, decode_freq );
+		_pep_arith_decode_update( &decoder->ac, decode_result.prob );
+
+		// ( only corrupt data can escape out of order0 )
+		if( decode_result.symbol == PEP_FREQ_END ) decode_result.symbol = PEP_FREQ_END - 1;
+
+		_pep_context_insert( model, context_ref, decode_result.symbol );
+		PEP_UPDATE( order0, decode_result.symbol, model->freq_max, decoder->palette_count );
+	}
+
+	decoder->context_id = ( ( decoder->context_id << 8 ) | decode_result.symbol );
+	return ( uint8_t )decode_result.symbol;
+}
+
+// The decode loop is generated once per indices-per-byte, for every count
+// _pep_indices_per_byte() can give (PEP_INDEX_RADIX is a power of two, so
+// 1, 2, 4 or 8), so the unpacking is unrolled, and the caller picks one per
+// image.
+// Only whole byte-symbols are decoded here, the caller does the last
+// partially-filled one. expanded holds the output pixels of every symbol.
+typedef void ( *_pep_decode_kernel )( _pep_decoder* const decoder, const uint32_t expanded[ 256 ][ 8 ], uint32_t* out_pixels, const uint64_t symbols_count );
+
+#define PEP_DECODE_KERNEL( INDICES_PER_BYTE )\
+	static inline void _pep_decode_kernel_##INDICES_PER_BYTE( _pep_decoder* const decoder, const uint32_t expanded[ 256 ][ 8 ], uint32_t* out_pixels, const uint64_t symbols_count )\
+	{\
+		for( uint64_t b = 0; b < symbols_count; b++ )\
+		{\
+			memcpy( out_pixels, expanded[ _pep_decode_symbol( decoder ) ], INDICES_PER_BYTE * sizeof( uint32_t ) );\
+			out_pixels += INDICES_PER_BYTE;\
+		}\
+	}
+
+PEP_DECODE_KERNEL( 1 )
+PEP_DECODE_KERNEL( 2 )
+PEP_DECODE_KERNEL( 4 )
+PEP_DECODE_KERNEL( 8 )
+
+// Decodes the next count palette indices, for callers that need them a
+// row at a time. A byte-symbol that spans two calls is kept as pending.
+// out_indices needs 8 bytes of slack: every symbol is copied as 8 indices.
+static inline void _pep_decode_indices( _pep_decoder* const decoder, uint8_t* out_indices, uint32_t count )
+{
+	while( count > 0 && decoder->pending_count > 0 )
+	{
+		*out_indices++ = *decoder->pending++;
+		decoder->pending_count--;
+		count--;
+	}
+
+	const uint8_t indices_per_byte = decoder->indices_per_byte;
+	while( count >= indices_per_byte )
+	{
+		memcpy( out_indices, decoder->unpacked[ _pep_decode_symbol( decoder ) ], 8 );
+		out_indices += indices_per_byte;
+		count -= indices_per_byte;
+	}
+
+	if( count > 0 )
+	{
+		decoder->pending = decoder->unpacked[ _pep_decode_symbol( decoder ) ];
+		decoder->pending_count = indices_per_byte;
+		while( count > 0 )
+		{
+			*out_indices++ = *decoder->pending++;
+			decoder->pending_count--;
+			count--;
+		}
+	}
+}
+
+// Every byte-symbol unpacked into its base-radix digits (palette indices).
+// They're counted up like an odometer, which avoids 2048 divisions per call.
+static inline void _pep_unpacked_indices( const uint16_t palette_count, uint8_t unpacked[ 256 ][ 8 ] )
+{
+	const uint16_t radix = PEP_INDEX_RADIX( palette_count );
+	const uint8_t indices_per_byte = _pep_indices_per_byte( palette_count );
+	uint16_t digits[ 8 ] = { 0 };
+	for( uint16_t s = 0; s < 256; s++ )
+	{
+		for( uint8_t i = 0; i < indices_per_byte; i++ )
+		{
+			unpacked[ s ][ i ] = ( uint8_t )digits[ i ];
+		}
+		for( uint8_t i = 0; i < indices_per_byte && ++digits[ i ] == radix; i++ )
+		{
+			digits[ i ] = 0;
+		}
+	}
+}
+
+// The palette converted once into out_format, as the bytes of each pixel
+// (pep_bytes_per_pixel() of them). Indices past the palette can only come
+// from corrupt data, those become 0.
+// A recolor only changes which colors go in here: index i gets
+// palette[ remap[ i ] ] (either one optional), so decoding costs the same.
+static inline void _pep_output_palette( const pep* const in_pep, const pep_format out_format, const uint8_t transparent_first_color, const uint8_t pre_multiply, const uint32_t* const palette, const uint8_t* const remap, uint8_t out_palette[ 256 ][ 4 ] )
+{
+	const uint16_t palette_count = in_pep->palette_size ? in_pep->palette_size : 256;
+	// ( the smaller formats are packed from RGBA )
+	const pep_format color_format = ( out_format <= pep_argb ) ? out_format : pep_rgba;
+
+	const uint32_t* const colors = ( palette != NULL ) ? palette : in_pep->palette;
+
+	memset( out_palette, 0, 256 * 4 );
+	for( uint16_t i = 0; i < palette_count; i++ )
+	{
+		uint32_t color = colors[ ( remap != NULL ) ? remap[ i ] : i ];
+		if( i == 0 && transparent_first_color != 0 )
+		{
+			color &= ( in_pep->format <= pep_bgra ) ? 0x00ffffff : 0xffffff00;
+		}
+		color = _pep_reformat( color, in_pep->format, color_format );
+		if( pre_multiply != 0 )
+		{
+			color = _pep_pre_multiply( color, color_format );
+		}
+
+		const uint32_t r = color & 0xff;
+		const uint32_t g = ( color >> 8 ) & 0xff;
+		const uint32_t b = ( color >> 16 ) & 0xff;
+		const uint32_t a = color >> 24;
+		uint16_t packed = 0;
+		uint8_t* const out = out_palette[ i ];
+		switch( out_format )
+		{
+			case pep_rgb565:
+				packed = ( uint16_t )( ( ( r >> 3 ) << 11 ) | ( ( g >> 2 ) << 5 ) | ( b >> 3 ) );
+				memcpy( out, &packed, 2 );
+				break;
+			case pep_rgba5551:
+				packed = ( uint16_t )( ( ( r >> 3 ) << 11 ) | ( ( g >> 3 ) << 6 ) | ( ( b >> 3 ) << 1 ) | ( a >> 7 ) );
+				memcpy( out, &packed, 2 );
+				break;
+			case pep_rgba4444:
+				packed = ( uint16_t )( ( ( r >> 4 ) << 12 ) | ( ( g >> 4 ) << 8 ) | ( ( b >> 4 ) << 4 ) | ( a >> 4 ) );
+				memcpy( out, &packed, 2 );
+				break;
+			case pep_rgb24:
+				out[ 0 ] = ( uint8_t )r;
+				out[ 1 ] = ( uint8_t )g;
+				out[ 2 ] = ( uint8_t )b;
+				break;
+			case pep_bgr24:
+				out[ 0 ] = ( uint8_t )b;
+				out[ 1 ] = ( uint8_t )g;
+				out[ 2 ] = ( uint8_t )r;
+				break;
+			case pep_l8:
+				out[ 0 ] = ( uint8_t )( ( 77 * r + 150 * g + 29 * b + 128 ) >> 8 );
+				break;
+			case pep_a8:
+				out[ 0 ] = ( uint8_t )a;
+				break;
+			default:
+				memcpy( out, &color, 4 );
+				break;
+		}
+	}
+}
+
+// pep supports pre-multiplying the RGB channels with the A channel.
+static inline uint32_t _pep_pre_multiply( const uint32_t pixel, const pep_format format )
+{
+	uint8_t* bytes = ( uint8_t* )( &pixel );
+
+	if( format <= pep_bgra )
+	{
+		uint32_t scaled_a = ( uint32_t )( bytes[ 3 ] ) * 257;
+		bytes[ 1 ] = ( uint8_t )( ( ( uint32_t )( bytes[ 1 ] ) * scaled_a + 32896 ) >> 16 );
+		bytes[ 2 ] = ( uint8_t )( ( ( uint32_t )( bytes[ 2 ] ) * scaled_a + 32896 ) >> 16 );
+		bytes[ 3 ] = ( uint8_t )( ( ( uint32_t )( bytes[ 3 ] ) * scaled_a + 32896 ) >> 16 );
+	}
+	else
+	{
+		uint32_t scaled_a = ( uint32_t )( bytes[ 0 ] ) * 257;
+		bytes[ 0 ] = ( uint8_t )( ( ( uint32_t )( bytes[ 0 ] ) * scaled_a + 32896 ) >> 16 );
+		bytes[ 1 ] = ( uint8_t )( ( ( uint32_t )( bytes[ 1 ] ) * scaled_a + 32896 ) >> 16 );
+		bytes[ 2 ] = ( uint8_t )( ( ( uint32_t )( bytes[ 2 ] ) * scaled_a + 32896 ) >> 16 );
+	}
+
+	return pixel;
 }
 
 // pep supports "dynamic formats", where you can specify what the in-bytes are,
@@ -400,29 +1540,312 @@ static inline uint32_t _pep_reformat( const uint32_t in_color, const pep_format
 	}
 }
 
-// The format of the in_pixels has to be the same as in_format.
-// out_format is the one applied to the newly compressed pep
-static inline pep pep_compress( const uint32_t* in_pixels, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_channel_bits in_channel_bits )
+// Sorts 32bit keys via 4 passes of 8bit counting-sort (LSD radix sort).
+// The result ends up back in keys, temp has to be at least count long.
+static inline void _pep_radix_sort( uint32_t* const keys, uint32_t* const temp, const uint32_t count )
 {
-	pep out_pep = { 0 };
-	uint32_t pixels_area = width * height;
+	uint32_t* src = keys;
+	uint32_t* dst = temp;
 
-	if( in_pixels == NULL || pixels_area == 0 ) return out_pep;
+	for( uint8_t shift = 0; shift < 32; shift += 8 )
+	{
+		uint32_t offsets[ 256 ] = { 0 };
+		for( uint32_t i = 0; i < count; i++ ) offsets[ ( src[ i ] >> shift ) & 0xff ]++;
 
-	const uint32_t* p = in_pixels;
-	const uint32_t* p_end = p + pixels_area;
+		uint32_t total = 0;
+		for( uint16_t b = 0; b < 256; b++ )
+		{
+			const uint32_t n = offsets[ b ];
+			offsets[ b ] = total;
+			total += n;
+		}
 
-	out_pep.bytes = ( uint8_t* )PEP_MALLOC( pixels_area * sizeof( uint32_t ) * 2 ); // highly unlikely it will be >2x the size
-	out_pep.width = width;
-	out_pep.height = height;
-	out_pep.format = in_format;
-	out_pep.channel_bits = in_channel_bits;
+		for( uint32_t i = 0; i < count; i++ ) dst[ offsets[ ( src[ i ] >> shift ) & 0xff ]++ ] = src[ i ];
+
+		uint32_t* swap = src;
+		src = dst;
+		dst = swap;
+	}
+}
+
+// Finds the widest channel of a median-cut box, returning its range.
+static inline uint8_t _pep_box_widest_channel( const uint32_t* const colors, const uint32_t begin, const uint32_t end, uint8_t* const out_channel )
+{
+	uint8_t widest = 0;
+	*out_channel = 0;
+
+	for( uint8_t c = 0; c < 4; c++ )
+	{
+		uint32_t lo = 255;
+		uint32_t hi = 0;
+		for( uint32_t i = begin; i < end; i++ )
+		{
+			const uint32_t v = ( colors[ i ] >> ( c * 8 ) ) & 0xff;
+			lo = v < lo ? v : lo;
+			hi = v > hi ? v : hi;
+		}
+		if( begin < end && hi - lo > widest )
+		{
+			widest = ( uint8_t )( hi - lo );
+			*out_channel = c;
+		}
+	}
+
+	return widest;
+}
+
+// Finds the closest palette color (squared distance over all 4 channels).
+// The channels are stored as separate arrays so the distance loop is plain
+// data-parallel code the compiler turns into SIMD, the argmin is then found
+// with a second pass.
+static inline uint8_t _pep_nearest_color( const uint32_t color, int32_t channels[ 4 ][ 256 ], const uint16_t palette_count )
+{
+	const int32_t c0 = color & 0xff;
+	const int32_t c1 = ( color >> 8 ) & 0xff;
+	const int32_t c2 = ( color >> 16 ) & 0xff;
+	const int32_t c3 = color >> 24;
+
+	int32_t distances[ 256 ];
+	int32_t best = 0x7fffffff;
+	for( uint16_t i = 0; i < palette_count; i++ )
+	{
+		const int32_t d0 = channels[ 0 ][ i ] - c0;
+		const int32_t d1 = channels[ 1 ][ i ] - c1;
+		const int32_t d2 = channels[ 2 ][ i ] - c2;
+		const int32_t d3 = channels[ 3 ][ i ] - c3;
+		const int32_t d = d0 * d0 + d1 * d1 + d2 * d2 + d3 * d3;
+		distances[ i ] = d;
+		best = d < best ? d : best;
+	}
+
+	uint16_t i = 0;
+	while( distances[ i ] != best ) i++;
+	return ( uint8_t )i;
+}
+
+// Reduces in_pixels to at most max_colors (1-256) colors, returning a new
+// pixel buffer of the same size (free it with PEP_FREE).
+// It uses a pixel-weighted median-cut over the unique colors, which runs in
+// O(n log n) regardless of the image content, then maps every pixel to its
+// nearest palette color through a small color cache.
+// dither applies a 4x4 ordered (Bayer) dither to the non-alpha channels,
+// which helps photo-like images, but is best left at 0 for pixel art.
+static inline uint32_t* pep_quantize( const uint32_t* in_pixels, const uint16_t width, const uint16_t height, const pep_format in_format, const uint16_t max_colors, const uint8_t dither )
+{
+	const uint64_t pixels_area = ( uint64_t )width * height;
+	if( in_pixels == NULL || pixels_area == 0 || in_format > pep_argb || max_colors == 0 || max_colors > 256 ) return NULL;
+	if( pixels_area > SIZE_MAX / ( sizeof( uint32_t ) * 4 ) ) return NULL;
+
+	uint32_t* out_pixels = ( uint32_t* )PEP_MALLOC( ( size_t )pixels_area * sizeof( uint32_t ) );
+	uint32_t* colors = ( uint32_t* )PEP_MALLOC( ( size_t )pixels_area * sizeof( uint32_t ) * 4 );
+	if( out_pixels == NULL || colors == NULL )
+	{
+		PEP_FREE( out_pixels );
+		PEP_FREE( colors );
+		return NULL;
+	}
+	uint32_t* counts = colors + pixels_area;
+	uint32_t* temp_colors = counts + pixels_area;
+	uint32_t* temp_counts = temp_colors + pixels_area;
+
+	////////
+	// unique colors with their pixel counts
+
+	memcpy( colors, in_pixels, ( size_t )pixels_area * sizeof( uint32_t ) );
+	_pep_radix_sort( colors, temp_colors, ( uint32_t )pixels_area );
+
+	uint32_t unique_count = 0;
+	for( uint32_t i = 0; i < pixels_area; i++ )
+	{
+		if( unique_count > 0 && colors[ unique_count - 1 ] == colors[ i ] )
+		{
+			counts[ unique_count - 1 ]++;
+			continue;
+		}
+		colors[ unique_count ] = colors[ i ];
+		counts[ unique_count++ ] = 1;
+	}
+
+	if( unique_count <= max_colors )
+	{
+		memcpy( out_pixels, in_pixels, ( size_t )pixels_area * sizeof( uint32_t ) );
+		PEP_FREE( colors );
+		return out_pixels;
+	}
+
+	////////
+	// median-cut: repeatedly split the box with the widest channel range at
+	// its pixel-weighted median, until there are max_colors boxes
+
+	uint32_t box_begin[ 257 ];
+	uint8_t box_range[ 256 ];
+	uint8_t box_channel[ 256 ];
+	uint16_t box_count = 1;
+	box_begin[ 0 ] = 0;
+	box_begin[ 1 ] = unique_count;
+	box_range[ 0 ] = _pep_box_widest_channel( colors, 0, unique_count, &box_channel[ 0 ] );
+
+	while( box_count < max_colors )
+	{
+		uint16_t split_box = 0;
+		for( uint16_t b = 1; b < box_count; b++ )
+		{
+			if( box_range[ b ] > box_range[ split_box ] ) split_box = b;
+		}
+		if( box_range[ split_box ] == 0 ) break; // every box is a single color
+
+		// counting-sort the box by its widest channel, keeping counts paired
+		const uint32_t begin = box_begin[ split_box ];
+		const uint32_t end = box_begin[ split_box + 1 ];
+		const uint8_t shift = box_channel[ split_box ] * 8;
+
+		uint32_t offsets[ 256 ] = { 0 };
+		uint64_t weight = 0;
+		for( uint32_t i = begin; i < end; i++ )
+		{
+			offsets[ ( colors[ i ] >> shift ) & 0xff ]++;
+			weight += counts[ i ];
+		}
 
-	uint8_t* data_ref = out_pep.bytes;
+		uint32_t total = 0;
+		for( uint16_t v = 0; v < 256; v++ )
+		{
+			const uint32_t n = offsets[ v ];
+			offsets[ v ] = total;
+			total += n;
+		}
+
+		for( uint32_t i = begin; i < end; i++ )
+		{
+			const uint32_t o = offsets[ ( colors[ i ] >> shift ) & 0xff ]++;
+			temp_colors[ o ] = colors[ i ];
+			temp_counts[ o ] = counts[ i ];
+		}
+		memcpy( colors + begin, temp_colors, ( end - begin ) * sizeof( uint32_t ) );
+		memcpy( counts + begin, temp_counts, ( end - begin ) * sizeof( uint32_t ) );
+
+		// weighted median, keeping both halves non-empty
+		uint32_t median = begin + 1;
+		uint64_t accumulated = counts[ begin ];
+		while( median < end - 1 && accumulated * 2 < weight )
+		{
+			accumulated += counts[ median++ ];
+		}
+
+		for( uint16_t b = box_count; b > split_box; b-- )
+		{
+			box_begin[ b + 1 ] = box_begin[ b ];
+			box_range[ b ] = box_range[ b - 1 ];
+			box_channel[ b ] = box_channel[ b - 1 ];
+		}
+		box_begin[ split_box + 1 ] = median;
+		box_count++;
+
+		box_range[ split_box ] = _pep_box_widest_channel( colors, begin, median, &box_channel[ split_box ] );
+		box_range[ split_box + 1 ] = _pep_box_widest_channel( colors, median, end, &box_channel[ split_box + 1 ] );
+	}
+
+	////////
+	// palette is the pixel-weighted average of every box
+
+	int32_t channels[ 4 ][ 256 ];
+	for( uint16_t b = 0; b < box_count; b++ )
+	{
+		uint64_t sums[ 4 ] = { 0 };
+		uint64_t weight = 0;
+		for( uint32_t i = box_begin[ b ]; i < box_begin[ b + 1 ]; i++ )
+		{
+			for( uint8_t c = 0; c < 4; c++ )
+			{
+				sums[ c ] += ( uint64_t )( ( colors[ i ] >> ( c * 8 ) ) & 0xff ) * counts[ i ];
+			}
+			weight += counts[ i ];
+		}
+		for( uint8_t c = 0; c < 4; c++ )
+		{
+			channels[ c ][ b ] = ( int32_t )( ( sums[ c ] + ( weight >> 1 ) ) / weight );
+		}
+	}
 
 	////////
-	// palette construction
+	// map every pixel to its nearest palette color
+
+	static const uint8_t bayer[ 4 ][ 4 ] =
+	{
+		{ 0, 8, 2, 10 },
+		{ 12, 4, 14, 6 },
+		{ 3, 11, 1, 9 },
+		{ 15, 7, 13, 5 }
+	};
+
+	// the dither spreads over roughly one step of an evenly spaced palette
+	int32_t spread = 0;
+	if( dither != 0 )
+	{
+		int32_t steps = 1;
+		while( steps * steps * steps < box_count ) steps++;
+		spread = 256 / steps;
+	}
+	const uint8_t alpha_shift = in_format <= pep_bgra ? 24 : 0;
+
+	// direct-mapped color -> palette-index cache, reusing the sort buffers.
+	// Every slot starts as palette color 0, so a stale hit is still correct.
+	const uint32_t cache_size = pixels_area >= 4096 ? 4096 : 1u << ( 31 - PEP_COUNT_LEADING_ZEROS( ( uint32_t )pixels_area ) );
+	const uint8_t cache_shift = 32 - ( 31 - PEP_COUNT_LEADING_ZEROS( cache_size ) );
+	uint32_t* cache_colors = temp_colors;
+	uint8_t* cache_indices = ( uint8_t* )temp_counts;
+	const uint32_t first_color = ( uint32_t )channels[ 0 ][ 0 ] | ( ( uint32_t )channels[ 1 ][ 0 ] << 8 ) | ( ( uint32_t )channels[ 2 ][ 0 ] << 16 ) | ( ( uint32_t )channels[ 3 ][ 0 ] << 24 );
+	const uint8_t first_index = _pep_nearest_color( first_color, channels, box_count );
+	for( uint32_t i = 0; i < cache_size; i++ )
+	{
+		cache_colors[ i ] = first_color;
+		cache_indices[ i ] = first_index;
+	}
+
+	for( uint32_t y = 0; y < height; y++ )
+	{
+		for( uint32_t x = 0; x < width; x++ )
+		{
+			uint32_t color = in_pixels[ y * width + x ];
+
+			if( spread != 0 )
+			{
+				const int32_t offset = ( ( bayer[ y & 3 ][ x & 3 ] * 2 - 15 ) * spread ) / 32;
+				uint32_t dithered = color & ( 0xffu << alpha_shift );
+				for( uint8_t shift = 0; shift < 32; shift += 8 )
+				{
+					if( shift == alpha_shift ) continue;
+					int32_t v = ( int32_t )( ( color >> shift ) & 0xff ) + offset;
+					v = v < 0 ? 0 : ( v > 255 ? 255 : v );
+					dithered |= ( uint32_t )v << shift;
+				}
+				color = dithered;
+			}
+
+			const uint32_t slot = cache_shift < 32 ? ( color * 2654435761u ) >> cache_shift : 0;
+			if( cache_colors[ slot ] != color )
+			{
+				cache_colors[ slot ] = color;
+				cache_indices[ slot ] = _pep_nearest_color( color, channels, box_count );
+			}
+
+			const uint8_t index = cache_indices[ slot ];
+			out_pixels[ y * width + x ] = ( uint32_t )channels[ 0 ][ index ] | ( ( uint32_t )channels[ 1 ][ index ] << 8 ) | ( ( uint32_t )channels[ 2 ][ index ] << 16 ) | ( ( uint32_t )channels[ 3 ][ index ] << 24 );
+		}
+	}
 
+	PEP_FREE( colors );
+	return out_pixels;
+}
+
+// Builds the palette of in_pixels on top of the palette_count colors that
+// are already in palette (so several frames can share one).
+// Returns 0 when there are more than 256 colors.
+static inline uint8_t _pep_build_palette( const uint32_t* const in_pixels, const uint64_t pixels_area, uint32_t palette[ 256 ], uint16_t* const io_palette_count )
+{
+	const uint32_t* p = in_pixels;
+	const uint32_t* const p_end = in_pixels + pixels_area;
+	uint16_t palette_count = *io_palette_count;
 	uint32_t last_p = 0;
 	uint32_t this_p = 0;
 
@@ -437,105 +1860,145 @@ static inline pep pep_compress( const uint32_t* in_pixels, const uint16_t width,
 		}
 
 		uint16_t n = 0;
-		while( n < out_pep.palette_size && this_p != out_pep.palette[ n ] )
+		while( n < palette_count && this_p != palette[ n ] )
 		{
 			n++;
 		}
 
-		if( n >= out_pep.palette_size && ( ( uint16_t ) out_pep.palette_size + 1 ) < 256 )
+		if( n >= palette_count )
 		{
-			out_pep.palette[ out_pep.palette_size++ ] = this_p;
+			// more than 256 colors can't be indexed, so bail out before any
+			// pixels get silently mapped to the wrong color
+			if( palette_count >= 256 ) return 0;
+
+			palette[ palette_count++ ] = this_p;
 		}
 
 		last_p = this_p;
 		p++;
 	}
 
+	*io_palette_count = palette_count;
+	return 1;
+}
+
+// Codes in_pixels with model as it is (pep_compress() starts it from
+// scratch, animations keep it warm across frames), appending the bytes at
+// *io_bytes + *io_size. The buffer starts at half the packed size and
+// doubles when it has to, instead of reserving the worst case.
+// Every symbol's context is the symbol before it, unless context_symbols
+// gives one per symbol (delta animations use the previous frame's).
+// Returns 0 when out of memory (*io_bytes is still the caller's to free).
+static inline uint8_t _pep_encode_pixels( const uint32_t* const in_pixels, const uint64_t pixels_area, const uint32_t palette[ 256 ], const uint16_t palette_count, _pep_model* const model, const uint8_t* context_symbols, uint8_t** const io_bytes, size_t* const io_capacity, size_t* const io_size )
+{
 	////////
 	// pixels to packed-palette-indices and PPM order-2 compression
 
-	uint8_t bits_per_index = PEP_BITS_TO_FIT( out_pep.palette_size );
-	if( bits_per_index > 8 ) bits_per_index = 8; // only 8 bits in a byte
-
-	const uint8_t indices_per_byte = 8 / bits_per_index;
-	const uint8_t index_mask = ( 1 << bits_per_index ) - 1;
+	const uint16_t radix = PEP_INDEX_RADIX( palette_count );
+	const uint8_t indices_per_byte = _pep_indices_per_byte( palette_count );
 
-	static _pep_context contexts[ PEP_CONTEXTS_MAX + 1 ];
-	memset( contexts, 0, sizeof( _pep_context ) * ( PEP_CONTEXTS_MAX + 1 ) );
+	const size_t guess = ( size_t )( pixels_area / indices_per_byte / 2 ) + 64;
+	if( *io_bytes == NULL || *io_capacity - *io_size < guess )
+	{
+		const size_t capacity = ( *io_size + guess > *io_capacity * 2 ) ? *io_size + guess : *io_capacity * 2;
+		uint8_t* const grown = ( uint8_t* )PEP_REALLOC( *io_bytes, capacity );
+		if( grown == NULL ) return 0;
+		*io_bytes = grown;
+		*io_capacity = capacity;
+	}
 
-	_pep_context* order0 = &contexts[ PEP_CONTEXTS_MAX ];
-	for( uint64_t i = 0; i < PEP_FREQ_N; i++ ) order0->freq[ i ] = 1;
-	order0->sum = PEP_FREQ_N;
+	_pep_context* const order0 = &model->contexts[ PEP_CONTEXTS_MAX ];
 
 	_pep_ac_encode ac = { 0 };
 	ac.range = ( uint32_t )( ( 1llu << 32 ) - 1 );
-	ac.data_ref = data_ref;
+	ac.data_ref = *io_bytes + *io_size;
 	uint64_t context_id = 0;
 
-	p = in_pixels;
+	_pep_run run = { 0 };
+
+	const uint32_t* p = in_pixels;
+	const uint32_t* const p_end = in_pixels + pixels_area;
 	uint8_t indices_in_byte = 0;
+	uint16_t digit_place = 1;
 	uint8_t symbol = 0;
 
-	uint16_t freq_max = PEP_FREQ_MAX;
-
 	while( p < p_end || indices_in_byte > 0 )
 	{
 		if( p < p_end )
 		{
 			uint16_t index = 0;
-			while( index < out_pep.palette_size && *p != out_pep.palette[ index ] )
+			while( index < palette_count && *p != palette[ index ] )
 			{
-				if( ++index >= 256 )
-				{
-					index = 0;
-					break;
-				}
+				index++;
 			}
 
-			symbol |= ( index << ( indices_in_byte * bits_per_index ) );
+			symbol += index * digit_place;
+			digit_place *= radix;
 			++indices_in_byte;
 			++p;
 		}
 
 		if( indices_in_byte >= indices_per_byte || ( p >= p_end && indices_in_byte > 0 ) )
 		{
-			_pep_context* const context_ref = &contexts[ context_id % PEP_CONTEXTS_MAX ];
+			// ( a symbol writes at most 8 bytes, with its escape, and the
+			// final flush 4 more )
+			if( *io_capacity - ( size_t )( ac.data_ref - *io_bytes ) < 16 )
+			{
+				const size_t used = ( size_t )( ac.data_ref - *io_bytes );
+				uint8_t* const grown = ( uint8_t* )PEP_REALLOC( *io_bytes, *io_capacity * 2 );
+				if( grown == NULL ) return 0;
+				*io_bytes = grown;
+				*io_capacity *= 2;
+				ac.data_ref = grown + used;
+			}
+
+			if( context_symbols ) context_id = *context_symbols++;
+			_pep_context* const context_ref = _pep_model_context( model, context_id % PEP_CONTEXTS_MAX );
 			const uint32_t context_sum = context_ref->sum;
 
-			if( context_sum != 0 && context_ref->freq[ symbol ] != 0 )
+			_pep_prob prob = { 0 };
+			uint32_t position = PEP_FREQ_END;
+			if( run.context == context_ref && run.symbol == symbol )
+			{
+				position = run.position;
+				prob.low = run.low;
+			}
+			else if( context_sum != 0 )
+			{
+				position = _pep_context_find( context_ref, symbol, &prob.low );
+				if( position < context_ref->count && context_ref->symbols[ position ] != symbol ) position = PEP_FREQ_END;
+			}
+
+			if( position < context_ref->count )
 			{
-				_pep_prob prob = _pep_get_prob_from_ctx( context_ref, symbol );
+				prob.high = prob.low + context_ref->freq[ position ];
+				prob.scale = context_sum;
 				_pep_arith_encode( &ac, prob );
-				PEP_UPDATE( context_ref, symbol, freq_max, out_pep.palette_size );
+				PEP_UPDATE( context_ref, position, model->freq_max, palette_count );
+				PEP_RUN_TRACK( run, context_ref, symbol, position, prob.low, context_sum );
 			}
 			else
 			{
+				run.context = NULL;
 				if( context_sum != 0 )
 				{
-					_pep_prob prob = _pep_get_prob_from_ctx( context_ref, PEP_FREQ_END );
-					_pep_arith_encode( &ac, prob );
+					_pep_arith_encode( &ac, _pep_get_escape_prob_from_ctx( context_ref ) );
 					_pep_arith_encode_normalize( &ac );
-					context_ref->freq[ PEP_FREQ_END ] ++;
+					context_ref->escape++;
 					context_ref->sum++;
 				}
 
-				_pep_prob prob = _pep_get_prob_from_ctx( order0, symbol );
-				_pep_arith_encode( &ac, prob );
-
-				if( context_sum == 0 )
-				{
-					context_ref->freq[ PEP_FREQ_END ] = 1;
-					context_ref->sum = 1;
-				}
-				context_ref->freq[ symbol ] = 1;
-				context_ref->sum++;
-				PEP_UPDATE( order0, symbol, freq_max, out_pep.palette_size );
+				// ( order0 holds every symbol, so its positions are the symbols )
+				_pep_arith_encode( &ac, _pep_get_prob_from_ctx( order0, symbol ) );
+				_pep_context_insert( model, context_ref, symbol );
+				PEP_UPDATE( order0, symbol, model->freq_max, palette_count );
 			}
 
 			_pep_arith_encode_normalize( &ac );
 			context_id = ( ( context_id << 8 ) | symbol );
 
 			symbol = 0;
+			digit_place = 1;
 			indices_in_byte = 0;
 		}
 	}
@@ -547,157 +2010,519 @@ static inline pep pep_compress( const uint32_t* in_pixels, const uint16_t width,
 		*ac.data_ref++ = byte;
 	}
 
-	out_pep.bytes_size = ac.data_ref - out_pep.bytes;
-	out_pep.bytes = ( uint8_t* )PEP_REALLOC( out_pep.bytes, out_pep.bytes_size );
-
-	return out_pep;
+	*io_size = ( size_t )( ac.data_ref - *io_bytes );
+	return !model->failed;
 }
 
-// You can decompress a pep into any format via out_format, it will correctly
-// do it for you via in_pep->format.
-// If you want the first color to be 0 alpha, set transparent_first_color to 1
-// otherwise just make it 0
-static inline uint32_t* pep_decompress( const pep* const in_pep, const pep_format out_format, const uint8_t transparent_first_color, uint8_t const pre_multiply )
+// The format of the in_pixels has to be the same as in_format.
+// out_format is the one applied to the newly compressed pep
+static inline pep pep_compress( const uint32_t* in_pixels, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_channel_bits in_channel_bits )
 {
-	if( in_pep == NULL ) return NULL;
-	if( in_pep->bytes == NULL || in_pep->bytes_size == 0 || in_pep->width == 0 || in_pep->height == 0 ) return NULL;
+	pep out_pep = { 0 };
+	const uint64_t pixels_area = ( uint64_t )width * height;
 
-	const uint32_t area = in_pep->width * in_pep->height;
-	uint8_t* data_ref = in_pep->bytes;
-	uint32_t* out_pixels = ( uint32_t* )PEP_MALLOC( area * sizeof( uint32_t ) );
+	if( in_pixels == NULL || pixels_area == 0 || in_format > pep_argb ) return out_pep;
 
-	uint64_t canvas_pos = 0;
+	// palette_count is the true amount of colors (1-256), palette_size stores
+	// it as a uint8_t where 0 means 256.
+	uint16_t palette_count = 0;
+	if( !_pep_build_palette( in_pixels, pixels_area, out_pep.palette, &palette_count ) ) return out_pep;
 
-	uint8_t bits_per_index = PEP_BITS_TO_FIT( in_pep->palette_size );
-	if( bits_per_index > 8 ) bits_per_index = 8; // only 8 bits in a byte
+	return _pep_compress_palette( in_pixels, width, height, in_format, in_channel_bits, out_pep.palette, palette_count );
+}
 
-	const uint8_t indices_per_byte = 8 / bits_per_index;
-	const uint8_t index_mask = ( 1 << bits_per_index ) - 1;
+// The rest of pep_compress(), once the palette of in_pixels is known.
+static inline pep _pep_compress_palette( const uint32_t* in_pixels, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_channel_bits in_channel_bits, const uint32_t palette[ 256 ], const uint16_t palette_count )
+{
+	pep out_pep = { 0 };
+	const uint64_t pixels_area = ( uint64_t )width * height;
+	memcpy( out_pep.palette, palette, palette_count * sizeof( uint32_t ) );
 
-	static _pep_context contexts[ PEP_CONTEXTS_MAX + 1 ];
-	memset( contexts, 0, sizeof( _pep_context ) * ( PEP_CONTEXTS_MAX + 1 ) );
+	out_pep.palette_size = ( uint8_t )palette_count;
+	out_pep.width = width;
+	out_pep.height = height;
+	out_pep.format = in_format;
+	out_pep.channel_bits = in_channel_bits;
 
-	_pep_context* order0 = &contexts[ PEP_CONTEXTS_MAX ];
-	for( uint64_t i = 0; i < PEP_FREQ_N; i++ ) order0->freq[ i ] = 1;
-	order0->sum = PEP_FREQ_N;
+	_pep_model model;
+	_pep_model_init( &model );
+	_pep_model_reset( &model );
 
-	////////
-	// decompress PPM order-2 structure into packed-palette-indices
+	size_t bytes_capacity = 0;
+	size_t bytes_size = 0;
+	const uint8_t success = _pep_encode_pixels( in_pixels, pixels_area, out_pep.palette, palette_count, &model, NULL, &out_pep.bytes, &bytes_capacity, &bytes_size );
+	_pep_model_free( &model );
+	if( !success )
+	{
+		PEP_FREE( out_pep.bytes );
+		out_pep.bytes = NULL;
+		return out_pep;
+	}
+
+	out_pep.bytes_size = bytes_size;
+	out_pep.bytes = ( uint8_t* )PEP_REALLOC( out_pep.bytes, out_pep.bytes_size );
+
+	return out_pep;
+}
+
+// Same as pep_compress(), but images with more than 256 colors are first
+// reduced to 256 colors via pep_quantize() instead of being rejected.
+static inline pep pep_compress_quantized( const uint32_t* in_pixels, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_channel_bits in_channel_bits, const uint8_t dither )
+{
+	pep out_pep = { 0 };
+	const uint64_t pixels_area = ( uint64_t )width * height;
+
+	if( in_pixels == NULL || pixels_area == 0 || in_format > pep_argb ) return out_pep;
+
+	// counting the colors stops at the 257th, so checking first is cheap,
+	// and each image is only ever compressed once
+	uint32_t palette[ 256 ];
+	uint16_t palette_count = 0;
+	if( _pep_build_palette( in_pixels, pixels_area, palette, &palette_count ) )
+	{
+		return _pep_compress_palette( in_pixels, width, height, in_format, in_channel_bits, palette, palette_count );
+	}
+
+	uint32_t* quantized = pep_quantize( in_pixels, width, height, in_format, 256, dither );
+	if( quantized == NULL ) return out_pep;
+
+	out_pep = pep_compress( quantized, width, height, in_format, in_channel_bits );
+	PEP_FREE( quantized );
+	return out_pep;
+}
+
+// You can decompress a pep into any format via out_format, it will correctly
+// do it for you via in_pep->format.
+// If you want the first color to be 0 alpha, set transparent_first_color to 1
+// otherwise just make it 0
+static inline uint32_t* pep_decompress( const pep* const in_pep, const pep_format out_format, const uint8_t transparent_first_color, uint8_t const pre_multiply )
+{
+	return pep_decompress_recolored( in_pep, out_format, transparent_first_color, pre_multiply, NULL, NULL );
+}
+
+// Like pep_decompress(), but with in_palette (in in_pep->format) instead of
+// in_pep->palette, and/or every index i drawn with color remap[ i ], so one
+// compressed image can be drawn with any amount of palettes.
+static inline uint32_t* pep_decompress_recolored( const pep* const in_pep, const pep_format out_format, const uint8_t transparent_first_color, uint8_t const pre_multiply, const uint32_t* const in_palette, const uint8_t* const remap )
+{
+	if( in_pep == NULL || out_format > pep_argb ) return NULL;
+	if( in_pep->bytes == NULL || in_pep->bytes_size == 0 || in_pep->width == 0 || in_pep->height == 0 ) return NULL;
 
-	uint32_t context_id = 0;
-	uint16_t freq_max = PEP_FREQ_MAX;
+	const uint64_t area = ( uint64_t )in_pep->width * in_pep->height;
+	if( area > SIZE_MAX / sizeof( uint32_t ) ) return NULL;
+	uint32_t* out_pixels = ( uint32_t* )PEP_MALLOC( ( size_t )area * sizeof( uint32_t ) );
+	if( out_pixels == NULL ) return NULL;
 
-	static uint32_t palette[ 256 ];
 	const uint16_t palette_count = in_pep->palette_size ? in_pep->palette_size : 256;
-	memcpy( palette, in_pep->palette, palette_count * sizeof( uint32_t ) );
-	const uint64_t packed_indices_size = area / indices_per_byte;
+	const uint8_t indices_per_byte = _pep_indices_per_byte( palette_count );
 
-	if( transparent_first_color != 0 )
+	// the palette in the output format, computed once instead of per pixel
+	uint32_t palette[ 256 ];
+	_pep_output_palette( in_pep, out_format, transparent_first_color, pre_multiply, in_palette, remap, ( uint8_t( * )[ 4 ] )palette );
+
+	// every byte-symbol expanded into its output pixels, so decoding one is
+	// a single small copy
+	static uint8_t unpacked[ 256 ][ 8 ];
+	_pep_unpacked_indices( palette_count, unpacked );
+	static uint32_t expanded[ 256 ][ 8 ];
+	for( uint16_t s = 0; s < 256; s++ )
 	{
-		if( in_pep->format <= pep_bgra )
+		for( uint8_t i = 0; i < indices_per_byte; i++ )
 		{
-			palette[ 0 ] = palette[ 0 ] & 0x00ffffff;
-		}
-		else
-		{
-			palette[ 0 ] = palette[ 0 ] & 0xffffff00;
+			expanded[ s ][ i ] = palette[ unpacked[ s ][ i ] ];
 		}
 	}
 
-	_pep_ac_decode ac = { 0 };
-	ac.range = ( uint32_t )( ( 1llu << 32 ) - 1 );
-	ac.data_ref = data_ref;
-	ac.end_of_data = data_ref + in_pep->bytes_size;
+	////////
+	// decompress PPM order-2 structure into packed-palette-indices
 
-	for( uint8_t i = 0; i < 4; ++i )
+	_pep_model model;
+	_pep_model_init( &model );
+	_pep_decoder decoder;
+	_pep_decoder_init( &decoder, in_pep, &model, 1 );
+
+	_pep_decode_kernel kernel = NULL;
+	switch( indices_per_byte )
 	{
-		uint8_t in_byte = 0;
-		if( ac.data_ref != ac.end_of_data )
+		case 1: kernel = _pep_decode_kernel_1; break;
+		case 2: kernel = _pep_decode_kernel_2; break;
+		case 4: kernel = _pep_decode_kernel_4; break;
+		case 8: kernel = _pep_decode_kernel_8; break;
+	}
+	if( kernel == NULL )
+	{
+		PEP_FREE( out_pixels );
+		return NULL;
+	}
+
+	// the encoder flushes a trailing partially-filled symbol
+	const uint64_t whole_symbols = area / indices_per_byte;
+	kernel( &decoder, ( const uint32_t( * )[ 8 ] )expanded, out_pixels, whole_symbols );
+
+	uint64_t canvas_pos = whole_symbols * indices_per_byte;
+	if( canvas_pos < area )
+	{
+		const uint32_t* const pixels = expanded[ _pep_decode_symbol( &decoder ) ];
+		memcpy( &out_pixels[ canvas_pos ], pixels, ( area - canvas_pos ) * sizeof( uint32_t ) );
+	}
+
+	_pep_model_free( &model );
+	if( model.failed )
+	{
+		PEP_FREE( out_pixels );
+		return NULL;
+	}
+	return out_pixels;
+}
+
+// Writes one row of palette indices as output pixels, each one repeated
+// scale times. Every case is a constant-size copy (or a broadcast store),
+// which compile down to plain stores.
+static inline void _pep_write_row( uint8_t* out, const uint8_t* const indices, const uint32_t count, const uint8_t palette[ 256 ][ 4 ], const uint8_t bytes_per_pixel, const uint8_t scale )
+{
+	if( scale == 1 )
+	{
+		switch( bytes_per_pixel )
 		{
-			in_byte = *ac.data_ref++;
+			case 1:
+				for( uint32_t x = 0; x < count; x++ ) out[ x ] = palette[ indices[ x ] ][ 0 ];
+				break;
+			case 2:
+				for( uint32_t x = 0; x < count; x++ ) memcpy( &out[ x * 2 ], palette[ indices[ x ] ], 2 );
+				break;
+			case 3:
+				for( uint32_t x = 0; x < count; x++ ) memcpy( &out[ x * 3 ], palette[ indices[ x ] ], 3 );
+				break;
+			default:
+				for( uint32_t x = 0; x < count; x++ ) memcpy( &out[ x * 4 ], palette[ indices[ x ] ], 4 );
+				break;
 		}
+		return;
+	}
 
-		ac.code = ( ac.code << 8 ) | in_byte;
+	for( uint32_t x = 0; x < count; x++ )
+	{
+		const uint8_t* const color = palette[ indices[ x ] ];
+		uint8_t k = 0;
+		switch( bytes_per_pixel )
+		{
+			case 1:
+				memset( out, color[ 0 ], scale );
+				break;
+			case 2:
+				for( ; k < scale; k++ ) memcpy( &out[ k * 2 ], color, 2 );
+				break;
+			case 3:
+				for( ; k < scale; k++ ) memcpy( &out[ k * 3 ], color, 3 );
+				break;
+			default:
+				#ifdef PEP_SSE2
+					{
+						uint32_t pixel;
+						memcpy( &pixel, color, 4 );
+						const __m128i block = _mm_set1_epi32( ( int )pixel );
+						for( ; k + 4 <= scale; k += 4 ) _mm_storeu_si128( ( __m128i* )&out[ k * 4 ], block );
+					}
+				#endif
+				for( ; k < scale; k++ ) memcpy( &out[ k * 4 ], color, 4 );
+				break;
+		}
+		out += scale * bytes_per_pixel;
 	}
+}
 
-	_pep_sym_decode decode_result;
-	for( uint64_t b = 0; b < packed_indices_size; b++ )
+// Writes count indices where only the last head pixels of the first one and
+// the first tail pixels of the last one are visible (a single index shows
+// head pixels), the rest are full scale-wide blocks.
+static inline void _pep_write_clipped( uint8_t* out, const _pep_canvas* const canvas, const uint8_t* const indices, const uint32_t count, const uint8_t head, const uint8_t tail )
+{
+	const uint8_t bytes_per_pixel = canvas->bytes_per_pixel;
+	const uint8_t scale = canvas->scale;
+	const uint8_t( *palette )[ 4 ] = ( const uint8_t( * )[ 4 ] )canvas->palette;
+	if( count > 1 && head == scale && tail == scale )
 	{
-		_pep_context* const context_ref = &contexts[ context_id % PEP_CONTEXTS_MAX ];
-		const uint32_t context_sum = context_ref->sum;
+		_pep_write_row( out, indices, count, palette, bytes_per_pixel, scale );
+		return;
+	}
 
-		uint8_t symbol_found = 0;
-		if( context_sum != 0 )
-		{
-			uint32_t decode_freq = _pep_arith_decode_curr_freq( &ac, context_sum );
-			decode_result = _pep_get_sym_from_freq( context_ref, decode_freq );
-			_pep_arith_decode_update( &ac, decode_result.prob );
+	_pep_write_row( out, indices, 1, palette, bytes_per_pixel, head );
+	if( count == 1 ) return;
+	out += head * bytes_per_pixel;
+	_pep_write_row( out, indices + 1, count - 2, palette, bytes_per_pixel, scale );
+	out += ( count - 2 ) * scale * bytes_per_pixel;
+	_pep_write_row( out, indices + count - 1, 1, palette, bytes_per_pixel, tail );
+}
 
-			if( decode_result.symbol != PEP_FREQ_END )
-			{
-				symbol_found = 1;
-				PEP_UPDATE( context_ref, decode_result.symbol, freq_max, in_pep->palette_size );
-			}
-			else
-			{
-				context_ref->freq[ PEP_FREQ_END ] ++;
-				context_ref->sum++;
-			}
+// Writes count indices to output row out_y from output column out_x,
+// clipped to the surface. Without a key the first visible row is written and
+// copied to the rest of its upscaled rows. With a key every row is written,
+// only the spans between key indices, and 8 key indices are skipped at once.
+static inline void _pep_canvas_run( const _pep_canvas* const canvas, const uint8_t* const indices, const uint32_t count, const uint32_t out_x, const uint32_t out_y )
+{
+	const int64_t scale = canvas->scale;
+	const int64_t run_x = canvas->left + ( int64_t )out_x * scale;
+	int64_t x0 = run_x, x1 = run_x + ( int64_t )count * scale;
+	int64_t y0 = canvas->top + ( int64_t )out_y * scale, y1 = y0 + scale;
+	if( x0 < 0 ) x0 = 0;
+	if( y0 < 0 ) y0 = 0;
+	if( x1 > canvas->width ) x1 = canvas->width;
+	if( y1 > canvas->height ) y1 = canvas->height;
+	if( x0 >= x1 || y0 >= y1 ) return;
+
+	const uint32_t first = ( uint32_t )( ( x0 - run_x ) / scale );
+	const uint32_t last = ( uint32_t )( ( x1 - 1 - run_x ) / scale );
+	const uint32_t visible = last - first + 1;
+	const uint8_t head = ( visible == 1 ) ? ( uint8_t )( x1 - x0 ) : ( uint8_t )( run_x + ( first + 1 ) * scale - x0 );
+	const uint8_t tail = ( uint8_t )( x1 - ( run_x + last * scale ) );
+	const uint8_t* const run = indices + first;
+	const uint8_t bytes_per_pixel = canvas->bytes_per_pixel;
+	uint8_t* row = canvas->pixels + ( size_t )y0 * canvas->stride + ( size_t )x0 * bytes_per_pixel;
+
+	if( canvas->key < 0 )
+	{
+		_pep_write_clipped( row, canvas, run, visible, head, tail );
+		const size_t row_size = ( size_t )( x1 - x0 ) * bytes_per_pixel;
+		for( int64_t copy = y0 + 1; copy < y1; copy++ )
+		{
+			memcpy( row + canvas->stride, row, row_size );
+			row += canvas->stride;
 		}
+		return;
+	}
 
-		if( !symbol_found )
+	const uint8_t key = ( uint8_t )canvas->key;
+	const uint64_t keys = 0x0101010101010101ull * key;
+	for( int64_t copy = y0; copy < y1; copy++, row += canvas->stride )
+	{
+		uint32_t i = 0;
+		while( i < visible )
 		{
-			uint32_t decode_freq = _pep_arith_decode_curr_freq( &ac, order0->sum );
-			decode_result = _pep_get_sym_from_freq( order0, decode_freq );
-			_pep_arith_decode_update( &ac, decode_result.prob );
+			uint64_t eight;
+			while( i + 8 <= visible && ( memcpy( &eight, run + i, 8 ), eight == keys ) ) i += 8;
+			while( i < visible && run[ i ] == key ) i++;
+			if( i == visible ) break;
+
+			const uint32_t start = i;
+			while( i < visible && run[ i ] != key ) i++;
+
+			const uint32_t offset = ( start == 0 ) ? 0 : head + ( start - 1 ) * canvas->scale;
+			const uint8_t span_head = ( start == 0 ) ? head : ( ( i == visible && i - start == 1 ) ? tail : canvas->scale );
+			const uint8_t span_tail = ( i == visible ) ? tail : canvas->scale;
+			_pep_write_clipped( row + ( size_t )offset * bytes_per_pixel, canvas, run + start, i - start, span_head, span_tail );
+		}
+	}
+}
 
-			if( context_sum == 0 )
+// Sets up a canvas for target, with the palette already in its format.
+// Returns 0 for an unknown format
+static inline uint8_t _pep_canvas_init( _pep_canvas* const canvas, const pep* const in_pep, const pep_target* const target, const uint32_t surface_width, const uint32_t surface_height, const int32_t x, const int32_t y, const int16_t key )
+{
+	const uint8_t bytes_per_pixel = pep_bytes_per_pixel( target->format );
+	if( bytes_per_pixel == 0 ) return 0;
+
+	canvas->pixels = ( uint8_t* )target->pixels;
+	canvas->stride = target->stride ? target->stride : ( size_t )surface_width * bytes_per_pixel;
+	canvas->left = x;
+	canvas->top = y;
+	canvas->width = surface_width;
+	canvas->height = surface_height;
+	canvas->bytes_per_pixel = bytes_per_pixel;
+	canvas->scale = target->upscale ? target->upscale : 1;
+	canvas->key = key;
+	_pep_output_palette( in_pep, target->format, target->transparent_first_color, target->pre_multiply, target->palette, target->remap, canvas->palette );
+	return 1;
+}
+
+// Writes the region { x, y, width, height } of a width * height image of
+// indices that's already decoded, oriented like _pep_decompress_canvas().
+// A rotated column is gathered into column (region height bytes) first.
+static inline void _pep_canvas_region( const _pep_canvas* const canvas, const uint8_t* const indices, const uint32_t width, const uint32_t height, const uint32_t region[ 4 ], const uint8_t orientation, uint8_t* const column )
+{
+	const uint32_t region_x = region[ 0 ], region_y = region[ 1 ], region_width = region[ 2 ], region_height = region[ 3 ];
+	const uint8_t flip_x = ( orientation & pep_flip_x ) != 0;
+	const uint8_t flip_y = ( orientation & pep_flip_y ) != 0;
+
+	if( !( orientation & pep_rotate_90 ) )
+	{
+		for( uint32_t row = region_y; row < region_y + region_height; row++ )
+		{
+			const uint8_t* run = indices + ( size_t )row * width + region_x;
+			if( flip_x )
 			{
-				context_ref->freq[ PEP_FREQ_END ] = 1;
-				context_ref->sum = 1;
+				for( uint32_t i = 0; i < region_width; i++ ) column[ i ] = run[ region_width - 1 - i ];
+				run = column;
 			}
-			context_ref->freq[ decode_result.symbol ] = 1;
-			context_ref->sum++;
-			PEP_UPDATE( order0, decode_result.symbol, freq_max, in_pep->palette_size );
+			_pep_canvas_run( canvas, run, region_width, flip_x ? width - region_x - region_width : region_x, flip_y ? height - 1 - row : row );
 		}
+		return;
+	}
 
-		////////
-		// convert packed-palette-indices to pixels
+	// source ( x, y ) goes to row x and column height - 1 - y
+	for( uint32_t col = region_x; col < region_x + region_width; col++ )
+	{
+		const uint8_t* source = indices + ( size_t )region_y * width + col;
+		for( uint32_t i = 0; i < region_height; i++, source += width )
+		{
+			column[ flip_x ? i : region_height - 1 - i ] = *source;
+		}
+		_pep_canvas_run( canvas, column, region_height, flip_x ? region_y : height - region_y - region_height, flip_y ? width - 1 - col : col );
+	}
+}
 
-		if( indices_per_byte > 1 )
+// Decodes in_pep onto a surface_width * surface_height surface, the image's
+// top-left output pixel landing at ( x, y ) in upscaled pixels.
+// Flips only change where a row goes and its order. Rotations decode a
+// tile of PEP_ROTATE_TILE rows, whose columns each become a short run in
+// one destination row, so the writes stay cache-friendly.
+// Rows that can't reach the surface anymore aren't decoded at all, unless
+// a warm_model (an animation's) has to see every symbol. Without one the
+// model starts from scratch.
+static inline uint8_t _pep_decompress_canvas( const pep* const in_pep, const pep_target* const target, const uint32_t surface_width, const uint32_t surface_height, const int32_t x, const int32_t y, const int16_t key, _pep_model* const warm_model )
+{
+	if( in_pep == NULL || target == NULL || target->pixels == NULL ) return 0;
+	if( in_pep->bytes == NULL || in_pep->bytes_size == 0 || in_pep->width == 0 || in_pep->height == 0 ) return 0;
+	if( pep_bytes_per_pixel( target->format ) == 0 ) return 0;
+
+	const uint32_t width = in_pep->width;
+	const uint32_t height = in_pep->height;
+	const uint8_t scale = target->upscale ? target->upscale : 1;
+	const uint8_t flip_x = ( target->orientation & pep_flip_x ) != 0;
+	const uint8_t flip_y = ( target->orientation & pep_flip_y ) != 0;
+	const uint8_t rotate = ( target->orientation & pep_rotate_90 ) != 0;
+	const int64_t out_width = ( int64_t )( rotate ? height : width ) * scale;
+	const int64_t out_height = ( int64_t )( rotate ? width : height ) * scale;
+
+	const uint8_t decode_all = ( warm_model != NULL );
+
+	// entirely off the surface
+	if( !decode_all && ( x >= ( int64_t )surface_width || y >= ( int64_t )surface_height || x + out_width <= 0 || y + out_height <= 0 ) ) return 1;
+
+	_pep_canvas canvas;
+	if( !_pep_canvas_init( &canvas, in_pep, target, surface_width, surface_height, x, y, key ) ) return 0;
+
+	const uint32_t tile_rows = rotate ? PEP_ROTATE_TILE : 1;
+	uint8_t* const row_indices = ( uint8_t* )PEP_MALLOC( tile_rows * width + 8 );
+	if( row_indices == NULL ) return 0;
+
+	_pep_model fresh_model;
+	if( !decode_all ) _pep_model_init( &fresh_model );
+	static uint8_t unpacked[ 256 ][ 8 ];
+	_pep_decoder decoder;
+	_pep_decoder_init( &decoder, in_pep, decode_all ? warm_model : &fresh_model, !decode_all );
+	_pep_unpacked_indices( decoder.palette_count, unpacked );
+	decoder.unpacked = ( const uint8_t( * )[ 8 ] )unpacked;
+
+	if( !rotate )
+	{
+		for( uint32_t row = 0; row < height; row++ )
 		{
-			uint8_t indices_in_byte = 0;
-			while( indices_in_byte < indices_per_byte && canvas_pos < area )
+			const uint32_t out_y = flip_y ? height - 1 - row : row;
+			const int64_t top = y + ( int64_t )out_y * scale;
+			if( !decode_all && ( flip_y ? top + scale <= 0 : top >= ( int64_t )surface_height ) ) break;
+
+			_pep_decode_indices( &decoder, row_indices, width );
+			if( top + scale <= 0 || top >= ( int64_t )surface_height ) continue;
+
+			if( flip_x )
 			{
-				const uint8_t palette_idx = ( decode_result.symbol >> ( indices_in_byte * bits_per_index ) ) & index_mask;
-				uint32_t pixel = ( palette_idx < palette_count ) ? _pep_reformat( palette[ palette_idx ], in_pep->format, out_format ) : 0;
-				if( pre_multiply != 0 )
+				for( uint32_t l = 0, r = width - 1; l < r; l++, r-- )
 				{
-					pixel = _pep_pre_multiply( pixel, out_format );
+					const uint8_t index = row_indices[ l ];
+					row_indices[ l ] = row_indices[ r ];
+					row_indices[ r ] = index;
 				}
-				out_pixels[ canvas_pos ] = pixel;
-				++canvas_pos;
-				++indices_in_byte;
 			}
+
+			_pep_canvas_run( &canvas, row_indices, width, 0, out_y );
 		}
-		else
+	}
+	else
+	{
+		// source ( x, y ) goes to row x and column height - 1 - y
+		uint8_t column[ PEP_ROTATE_TILE ];
+		for( uint32_t row = 0; row < height; row += PEP_ROTATE_TILE )
 		{
-			if( canvas_pos < area && decode_result.symbol < palette_count )
+			const uint32_t rows = ( height - row < PEP_ROTATE_TILE ) ? height - row : PEP_ROTATE_TILE;
+			const uint32_t column_x = flip_x ? row : height - row - rows;
+			const int64_t left = x + ( int64_t )column_x * scale;
+			if( !decode_all && ( flip_x ? left >= ( int64_t )surface_width : left + ( int64_t )rows * scale <= 0 ) ) break;
+
+			for( uint32_t r = 0; r < rows; r++ )
 			{
-				uint32_t pixel = _pep_reformat( palette[ decode_result.symbol ], in_pep->format, out_format );
-				if( pre_multiply != 0 )
+				_pep_decode_indices( &decoder, row_indices + r * width, width );
+			}
+			if( left + ( int64_t )rows * scale <= 0 || left >= ( int64_t )surface_width ) continue;
+
+			for( uint32_t col = 0; col < width; col++ )
+			{
+				const uint32_t out_y = flip_y ? width - 1 - col : col;
+				const int64_t top = y + ( int64_t )out_y * scale;
+				if( top + scale <= 0 || top >= ( int64_t )surface_height ) continue;
+
+				for( uint32_t r = 0; r < rows; r++ )
 				{
-					pixel = _pep_pre_multiply( pixel, out_format );
+					column[ flip_x ? r : rows - 1 - r ] = row_indices[ r * width + col ];
 				}
-				out_pixels[ canvas_pos ] = pixel;
-				++canvas_pos;
+				_pep_canvas_run( &canvas, column, rows, column_x, out_y );
 			}
 		}
-
-		context_id = ( ( context_id << 8 ) | decode_result.symbol );
 	}
 
-	return out_pixels;
+	PEP_FREE( row_indices );
+	const uint8_t failed = decoder.model->failed;
+	if( !decode_all ) _pep_model_free( &fresh_model );
+	return !failed;
+}
+
+// Like pep_decompress(), but writes into the caller's pixels, in any
+// pep_format, a row at a time (so rows can be padded via target->stride).
+// With target->upscale the first copy of every row is written from the
+// decoded indices, and the other upscale - 1 copies are plain row copies,
+// so the pixels are never stored at their original size.
+static inline uint8_t pep_decompress_into( const pep* const in_pep, const pep_target* const target )
+{
+	if( in_pep == NULL || target == NULL ) return 0;
+
+	const uint8_t scale = target->upscale ? target->upscale : 1;
+	const uint8_t rotate = ( target->orientation & pep_rotate_90 ) != 0;
+	const uint32_t out_width = ( uint32_t )( rotate ? in_pep->height : in_pep->width ) * scale;
+	const uint32_t out_height = ( uint32_t )( rotate ? in_pep->width : in_pep->height ) * scale;
+	return _pep_decompress_canvas( in_pep, target, out_width, out_height, 0, 0, -1, NULL );
+}
+
+// Like pep_decompress_into(), but composites onto a target_width *
+// target_height surface (in pixels), with the image's top-left pixel at
+// ( x, y ). Anything outside of the surface is clipped. When
+// target->transparent_first_color is set, the first color is a color-key:
+// its pixels are never written, so runs of it cost no writes at all.
+static inline uint8_t pep_decompress_onto( const pep* const in_pep, const pep_target* const target, const uint32_t target_width, const uint32_t target_height, const int32_t x, const int32_t y )
+{
+	if( target == NULL ) return 0;
+	return _pep_decompress_canvas( in_pep, target, target_width, target_height, x, y, target->transparent_first_color ? 0 : -1, NULL );
+}
+
+// How many bytes one pixel takes in format (0 for an unknown format).
+static inline uint8_t pep_bytes_per_pixel( const pep_format format )
+{
+	switch( format )
+	{
+		case pep_rgba:
+		case pep_bgra:
+		case pep_abgr:
+		case pep_argb:
+			return 4;
+		case pep_rgb565:
+		case pep_rgba5551:
+		case pep_rgba4444:
+			return 2;
+		case pep_rgb24:
+		case pep_bgr24:
+			return 3;
+		case pep_l8:
+		case pep_a8:
+			return 1;
+	}
+	return 0;
 }
 
 static inline void pep_free( pep* in_pep )
@@ -712,12 +2537,50 @@ static inline void pep_free( pep* in_pep )
 
 ////////
 
-static inline uint8_t* pep_serialize( const pep* in_pep, uint32_t* const out_size )
+// Writes value as a base-128 varint (lowest 7 bits first), and returns its
+// length (1-10 bytes).
+static inline uint8_t _pep_write_varint( uint8_t* const out_bytes, uint64_t value )
+{
+	uint8_t length = 0;
+	while( value >= 0x80 )
+	{
+		out_bytes[ length++ ] = ( uint8_t )( value | 0x80 );
+		value >>= 7;
+	}
+	out_bytes[ length++ ] = ( uint8_t )value;
+	return length;
+}
+
+// Reads a varint from *io_bytes and moves past it.
+// Returns 0 if it runs into bytes_end.
+static inline uint8_t _pep_read_varint( const uint8_t** const io_bytes, const uint8_t* const bytes_end, uint64_t* const out_value )
+{
+	const uint8_t* bytes_ref = *io_bytes;
+	uint64_t value = 0;
+	uint8_t shift = 0;
+	uint8_t byte_val;
+	do
+	{
+		if( bytes_ref >= bytes_end ) return 0;
+		byte_val = *bytes_ref++;
+		if( shift < 64 ) value |= ( ( uint64_t )( byte_val & 0x7f ) ) << shift;
+		shift += 7;
+	}
+	while( ( byte_val & 0x80 ) && shift < 70 );
+
+	*io_bytes = bytes_ref;
+	*out_value = value;
+	return 1;
+}
+
+// Writes everything before the compressed pixels (the header and the
+// palette) into out_head, and returns how many bytes that is.
+// Returns 0 for a pep that can't be serialized.
+static inline uint32_t _pep_serialize_head( const pep* const in_pep, uint8_t out_head[ PEP_HEAD_MAX_BYTES ] )
 {
 	if( !in_pep || !in_pep->width || !in_pep->height || !in_pep->bytes_size || !in_pep->bytes )
 	{
-		*out_size = 0;
-		return NULL;
+		return 0;
 	}
 
 	uint16_t palette_count = in_pep->palette_size ? in_pep->palette_size : 256;
@@ -725,17 +2588,7 @@ static inline uint8_t* pep_serialize( const pep* in_pep, uint32_t* const out_siz
 	const uint16_t w = in_pep->width - 1;
 	const uint16_t h = in_pep->height - 1;
 	const uint8_t is_small = ( w <= 255 && h <= 255 ) ? 1 : 0;
-	const uint8_t dim_bytes = is_small ? 2 : 3;
-
-	// calculate variable-length size bytes
-	uint8_t size_bytes = 0;
-	uint32_t temp_size = in_pep->bytes_size;
-	while( temp_size >= 0x80 )
-	{
-		size_bytes++;
-		temp_size >>= 7;
-	}
-	++size_bytes;
+	const uint8_t is_large = ( w > 0xfff || h > 0xfff ) ? 1 : 0;
 
 	// check if bitmap (black and white)
 	uint8_t is_bitmap = 0;
@@ -771,30 +2624,10 @@ static inline uint8_t* pep_serialize( const pep* in_pep, uint32_t* const out_siz
 		}
 	}
 
-	// calculate palette bytes
-	uint16_t palette_bytes = 0;
-	if( !is_bitmap )
-	{
-		const uint16_t channel_bits = 1 << in_pep->channel_bits;
-		if( channel_bits == 8 )
-		{
-			palette_bytes = palette_count * ( only_rgb ? 3 : 4 );
-		}
-		else
-		{
-			const uint16_t channels = only_rgb ? 3 : 4;
-			palette_bytes = ( channel_bits * channels * palette_count + 7 ) >> 3;
-		}
-	}
-
-	// allocate the exact size (subtract 1 for palette_size byte if bitmap)
-	const uint64_t total_size = dim_bytes + size_bytes + ( is_bitmap ? 0 : 1 ) + palette_bytes + in_pep->bytes_size + 4;
-	uint8_t* out_bytes = ( uint8_t* )PEP_MALLOC( total_size );
-	uint8_t* out_bytes_ref = out_bytes;
-	uint8_t* out_bytes_end = out_bytes + total_size;
+	uint8_t* out_bytes_ref = out_head;
 
-	// flags: format (2), channel_bits (2), is_small (1), only_rgb (1), is_bitmap (1)
-	*out_bytes_ref++ = ( in_pep->format & 0x3 ) | ( ( in_pep->channel_bits & 0x3 ) << 2 ) | ( ( is_small & 0x1 ) << 4 ) | ( ( only_rgb & 0x1 ) << 5 ) | ( ( is_bitmap & 0x1 ) << 6 );
+	// flags: format (2), channel_bits (2), is_small (1), only_rgb (1), is_bitmap (1), is_large (1)
+	*out_bytes_ref++ = ( in_pep->format & 0x3 ) | ( ( in_pep->channel_bits & 0x3 ) << 2 ) | ( ( is_small & 0x1 ) << 4 ) | ( ( only_rgb & 0x1 ) << 5 ) | ( ( is_bitmap & 0x1 ) << 6 ) | ( ( is_large & 0x1 ) << 7 );
 
 	// width/height
 	if( is_small )
@@ -802,6 +2635,14 @@ static inline uint8_t* pep_serialize( const pep* in_pep, uint32_t* const out_siz
 		*out_bytes_ref++ = w & 0xff;
 		*out_bytes_ref++ = h & 0xff;
 	}
+	else if( is_large )
+	{
+		// ( 16 bits each, past the 12 bits below )
+		*out_bytes_ref++ = ( w >> 8 ) & 0xff;
+		*out_bytes_ref++ = w & 0xff;
+		*out_bytes_ref++ = ( h >> 8 ) & 0xff;
+		*out_bytes_ref++ = h & 0xff;
+	}
 	else
 	{
 		const uint32_t packed_dims = ( ( w & 0xfff ) << 12 ) | ( h & 0xfff );
@@ -811,13 +2652,7 @@ static inline uint8_t* pep_serialize( const pep* in_pep, uint32_t* const out_siz
 	}
 
 	// variable-length size
-	uint32_t size = in_pep->bytes_size;
-	while( size >= 0x80 )
-	{
-		*out_bytes_ref++ = ( size | 0x80 ) & 0xff;
-		size >>= 7;
-	}
-	*out_bytes_ref++ = size;
+	out_bytes_ref += _pep_write_varint( out_bytes_ref, in_pep->bytes_size );
 
 	if( !is_bitmap )
 	{
@@ -874,41 +2709,94 @@ static inline uint8_t* pep_serialize( const pep* in_pep, uint32_t* const out_siz
 		}
 	}
 
-	memcpy( out_bytes_ref, in_pep->bytes, in_pep->bytes_size );
-	out_bytes_ref += in_pep->bytes_size;
-	*out_bytes_ref = '\0';
+	return ( uint32_t )( out_bytes_ref - out_head );
+}
+
+static inline uint8_t* pep_serialize( const pep* in_pep, uint32_t* const out_size )
+{
+	*out_size = 0;
+
+	uint8_t head[ PEP_HEAD_MAX_BYTES ];
+	const uint32_t head_size = _pep_serialize_head( in_pep, head );
+	if( head_size == 0 ) return NULL;
 
-	*out_size = out_bytes_ref - out_bytes;
+	// ( out_size can't describe more, see pep_serialize_into() )
+	if( in_pep->bytes_size > UINT32_MAX - head_size ) return NULL;
+
+	// allocate the exact size
+	const uint32_t total_size = head_size + ( uint32_t )in_pep->bytes_size;
+	uint8_t* out_bytes = ( uint8_t* )PEP_MALLOC( total_size );
+	if( out_bytes == NULL ) return NULL;
+
+	memcpy( out_bytes, head, head_size );
+	memcpy( out_bytes + head_size, in_pep->bytes, ( size_t )in_pep->bytes_size );
+
+	*out_size = total_size;
 	return out_bytes;
 }
 
-static inline pep pep_deserialize( const uint8_t* const in_bytes, const uint32_t in_bytes_size )
+// How many bytes pep_serialize()/pep_serialize_into() produce for in_pep.
+// Returns 0 for a pep that can't be serialized.
+static inline size_t pep_serialized_size( const pep* const in_pep )
 {
-	pep out_pep = { 0 };
+	uint8_t head[ PEP_HEAD_MAX_BYTES ];
+	const uint32_t head_size = _pep_serialize_head( in_pep, head );
+	return head_size ? ( size_t )head_size + in_pep->bytes_size : 0;
+}
+
+// Like pep_serialize(), but into the caller's out_bytes (e.g. straight into
+// a pack of many peps), nothing is allocated.
+// Returns the amount of bytes written, 0 on failure or if out_capacity is
+// too small (see pep_serialized_size()).
+static inline size_t pep_serialize_into( const pep* const in_pep, uint8_t* const out_bytes, const size_t out_capacity )
+{
+	if( out_bytes == NULL ) return 0;
 
-	if( !in_bytes || in_bytes_size == 0 ) return out_pep;
+	uint8_t head[ PEP_HEAD_MAX_BYTES ];
+	const uint32_t head_size = _pep_serialize_head( in_pep, head );
+	if( head_size == 0 || out_capacity < ( size_t )head_size + in_pep->bytes_size ) return 0;
+
+	memcpy( out_bytes, head, head_size );
+	memcpy( out_bytes + head_size, in_pep->bytes, in_pep->bytes_size );
+	return ( size_t )head_size + in_pep->bytes_size;
+}
+
+// Parses only the header: flags, dimensions, the size varint and the
+// palette size. in_bytes only has to hold those (PEP_HEADER_MAX_BYTES is
+// always enough), nothing is allocated or copied.
+// Returns 0 on failure, 1 on success
+static inline uint8_t pep_peek_info( const uint8_t* const in_bytes, const uint64_t in_bytes_size, pep_info* const out_info )
+{
+	if( !in_bytes || in_bytes_size == 0 || !out_info ) return 0;
 
 	const uint8_t* bytes_ref = in_bytes;
 	const uint8_t* const bytes_end = in_bytes + in_bytes_size;
+	pep_info info = { 0 };
 
 	// packed flags
-	if( bytes_ref + 1 > bytes_end ) return out_pep;
 	uint8_t packed_flags = *bytes_ref++;
-	out_pep.format = ( pep_format )( packed_flags & 0x3 );
-	out_pep.channel_bits = ( pep_channel_bits )( ( packed_flags >> 2 ) & 0x3 );
+	info.format = ( pep_format )( packed_flags & 0x3 );
+	info.channel_bits = ( pep_channel_bits )( ( packed_flags >> 2 ) & 0x3 );
 	uint8_t is_small = ( packed_flags >> 4 ) & 0x1;
 	uint8_t only_rgb = ( packed_flags >> 5 ) & 0x1;
 	uint8_t is_bitmap = ( packed_flags >> 6 ) & 0x1;
+	uint8_t is_large = ( packed_flags >> 7 ) & 0x1;
 
 	// width/height
-	uint8_t dim_bytes = is_small ? 2 : 3;
-	if( bytes_ref + dim_bytes > bytes_end ) return out_pep;
+	uint8_t dim_bytes = is_small ? 2 : ( is_large ? 4 : 3 );
+	if( ( uint64_t )( bytes_end - bytes_ref ) < dim_bytes ) return 0;
 	uint16_t w, h;
 	if( is_small )
 	{
 		w = *bytes_ref++;
 		h = *bytes_ref++;
 	}
+	else if( is_large )
+	{
+		w = ( uint16_t )( ( bytes_ref[ 0 ] << 8 ) | bytes_ref[ 1 ] );
+		h = ( uint16_t )( ( bytes_ref[ 2 ] << 8 ) | bytes_ref[ 3 ] );
+		bytes_ref += 4;
+	}
 	else
 	{
 		uint32_t packed_dims = ( *bytes_ref++ << 16 );
@@ -917,58 +2805,78 @@ static inline pep pep_deserialize( const uint8_t* const in_bytes, const uint32_t
 		w = ( packed_dims >> 12 ) & 0xfff;
 		h = packed_dims & 0xfff;
 	}
-	out_pep.width = w + 1;
-	out_pep.height = h + 1;
+	info.width = w + 1;
+	info.height = h + 1;
 
 	// variable-length size
-	uint32_t bytes_size = 0;
-	uint8_t shift = 0;
-	uint8_t byte_val;
-	do
+	if( !_pep_read_varint( &bytes_ref, bytes_end, &info.bytes_size ) ) return 0;
+
+	// palette size, a bitmap has none (it's always black and white)
+	uint32_t palette_bytes = 0;
+	if( is_bitmap )
 	{
-		if( bytes_ref >= bytes_end ) return out_pep;
-		byte_val = *bytes_ref++;
-		if( shift < 32 ) bytes_size |= ( ( uint32_t )( byte_val & 0x7f ) ) << shift;
-		shift += 7;
+		info.palette_count = 2;
+	}
+	else
+	{
+		if( bytes_ref >= bytes_end ) return 0;
+		info.palette_count = *bytes_ref ? *bytes_ref : 256;
+		bytes_ref++;
+
+		const uint8_t channel_bits = 1 << info.channel_bits;
+		if( channel_bits == 8 )
+		{
+			palette_bytes = info.palette_count * ( only_rgb ? 3 : 4 );
+		}
+		else
+		{
+			uint16_t channels = only_rgb ? 3 : 4;
+			palette_bytes = ( channel_bits * channels * info.palette_count + 7 ) >> 3;
+		}
 	}
-	while( ( byte_val & 0x80 ) && shift < 35 );
+
+	info.palette_offset = ( uint32_t )( bytes_ref - in_bytes );
+	info.data_offset = info.palette_offset + palette_bytes;
+	*out_info = info;
+	return 1;
+}
+
+// Like pep_deserialize(), but the returned pep's bytes point right into
+// in_bytes instead of a copy, so it's only valid as long as they are, and
+// must not be given to pep_free().
+static inline pep pep_deserialize_view( const uint8_t* const in_bytes, const uint64_t in_bytes_size )
+{
+	pep out_pep = { 0 };
+
+	pep_info info;
+	if( !pep_peek_info( in_bytes, in_bytes_size, &info ) ) return out_pep;
+	if( info.data_offset > in_bytes_size || in_bytes_size - info.data_offset < info.bytes_size ) return out_pep;
+
+	const uint8_t* bytes_ref = in_bytes + info.palette_offset;
+	uint8_t only_rgb = ( in_bytes[ 0 ] >> 5 ) & 0x1;
+	uint8_t is_bitmap = ( in_bytes[ 0 ] >> 6 ) & 0x1;
+	uint64_t bytes_size = info.bytes_size;
+	out_pep.format = info.format;
+	out_pep.channel_bits = info.channel_bits;
+	out_pep.width = info.width;
+	out_pep.height = info.height;
 	out_pep.bytes_size = bytes_size;
 
 	// handle bitmap or read palette
-	uint32_t remaining = ( uint32_t )( bytes_end - bytes_ref );
-
 	if( is_bitmap )
 	{
-		if( remaining < bytes_size ) return out_pep;
-
 		out_pep.palette_size = 2;
 		out_pep.palette[ 0 ] = out_pep.format <= pep_bgra ? 0xff000000 : 0x000000ff;
 		out_pep.palette[ 1 ] = 0xffffffff;
 	}
 	else
 	{
-		// palette size
-		if( remaining < 1 ) return out_pep;
-		out_pep.palette_size = *bytes_ref++;
-		remaining--;
-
-		uint16_t palette_count = out_pep.palette_size ? out_pep.palette_size : 256;
+		out_pep.palette_size = ( uint8_t )info.palette_count;
+		uint16_t palette_count = info.palette_count;
 
 		// palette
 		const uint8_t channel_bits = 1 << out_pep.channel_bits;
 		const uint8_t mask = ( 1 << channel_bits ) - 1;
-		uint32_t palette_bytes;
-		if( channel_bits == 8 )
-		{
-			palette_bytes = palette_count * ( only_rgb ? 3 : 4 );
-		}
-		else
-		{
-			uint16_t channels = only_rgb ? 3 : 4;
-			palette_bytes = ( channel_bits * channels * palette_count + 7 ) >> 3;
-		}
-
-		if( remaining < palette_bytes || remaining - palette_bytes < bytes_size ) return out_pep;
 
 		if( channel_bits == 8 )
 		{
@@ -1022,11 +2930,21 @@ static inline pep pep_deserialize( const uint8_t* const in_bytes, const uint32_t
 		}
 	}
 
+	out_pep.bytes = ( uint8_t* )( in_bytes + info.data_offset );
+	return out_pep;
+}
+
+static inline pep pep_deserialize( const uint8_t* const in_bytes, const uint64_t in_bytes_size )
+{
+	pep out_pep = pep_deserialize_view( in_bytes, in_bytes_size );
+	if( out_pep.bytes == NULL ) return out_pep;
+
 	// copy image data
-	out_pep.bytes = ( uint8_t* )PEP_MALLOC( bytes_size );
+	const uint8_t* const view_bytes = out_pep.bytes;
+	out_pep.bytes = ( uint8_t* )PEP_MALLOC( ( size_t )out_pep.bytes_size );
 	if( out_pep.bytes )
 	{
-		memcpy( out_pep.bytes, bytes_ref, bytes_size );
+		memcpy( out_pep.bytes, view_bytes, ( size_t )out_pep.bytes_size );
 	}
 
 	return out_pep;
@@ -1037,6 +2955,9 @@ static inline pep pep_deserialize( const uint8_t* const in_bytes, const uint32_t
 // e.g. "texture.pep", "assets/image.pep"
 
 // Saves pep into a file.
+// The header and palette are written from a small stack buffer, and the
+// compressed pixels straight from in_pep->bytes (in one writev() call with
+// PEP_WRITEV), so nothing is allocated or copied.
 // Returns 0 on failure, 1 on success
 static inline uint8_t pep_save( const pep* const in_pep, const char* const file_path )
 {
@@ -1045,31 +2966,61 @@ static inline uint8_t pep_save( const pep* const in_pep, const char* const file_
 		return 0;
 	}
 
-	uint32_t bytes_size = 0;
-	uint8_t* bytes = pep_serialize( in_pep, &bytes_size );
+	uint8_t head[ PEP_HEAD_MAX_BYTES ];
+	const uint32_t head_size = _pep_serialize_head( in_pep, head );
 
-	if( !bytes || bytes_size == 0 )
-	{
-		return 0;
-	}
-
-	FILE * file = fopen( file_path, "wb" );
-	if( !file )
+	if( head_size == 0 )
 	{
-		PEP_FREE( bytes );
 		return 0;
 	}
 
-	size_t written = fwrite( bytes, 1, bytes_size, file );
+	#ifdef PEP_WRITEV
+		const int file = open( file_path, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+		if( file < 0 )
+		{
+			return 0;
+		}
 
-	fclose( file );
-	PEP_FREE( bytes );
+		struct iovec parts[ 2 ] = { { head, head_size }, { in_pep->bytes, in_pep->bytes_size } };
+		struct iovec* part = parts;
+		int part_count = 2;
+		while( part_count > 0 )
+		{
+			ssize_t written = writev( file, part, part_count );
+			if( written < 0 )
+			{
+				if( errno == EINTR ) continue;
+				close( file );
+				return 0;
+			}
 
-	#ifdef PEP_DEBUG
-		printf( "pep: %lld\nfile: %lld\n", in_pep->bytes_size, written );
-	#endif
+			// ( a short write continues where it stopped )
+			while( part_count > 0 && ( size_t )written >= part->iov_len )
+			{
+				written -= ( ssize_t )part->iov_len;
+				part++;
+				part_count--;
+			}
+			if( part_count > 0 )
+			{
+				part->iov_base = ( uint8_t* )part->iov_base + written;
+				part->iov_len -= ( size_t )written;
+			}
+		}
 
-	return written == bytes_size;
+		return close( file ) == 0;
+	#else
+		FILE * file = fopen( file_path, "wb" );
+		if( !file )
+		{
+			return 0;
+		}
+
+		size_t written = fwrite( head, 1, head_size, file );
+		written += fwrite( in_pep->bytes, 1, in_pep->bytes_size, file );
+
+		return ( fclose( file ) == 0 ) && written == ( size_t )head_size + in_pep->bytes_size;
+	#endif
 }
 
 // Loads .pep file into returned pep struct
@@ -1109,7 +3060,7 @@ static inline pep pep_load( const char* const file_path )
 		return out_pep;
 	}
 
-	out_pep = pep_deserialize( bytes, ( uint32_t )read );
+	out_pep = pep_deserialize( bytes, ( uint64_t )read );
 	PEP_FREE( bytes );
 
 	#ifdef PEP_DEBUG
@@ -1119,6 +3070,1384 @@ static inline pep pep_load( const char* const file_path )
 	return out_pep;
 }
 
+// Reads only the first PEP_HEADER_MAX_BYTES of a .pep file, so probing lots
+// of files costs one small read each, and no allocation.
+// Returns 0 on failure, 1 on success
+static inline uint8_t pep_peek_info_file( const char* const file_path, pep_info* const out_info )
+{
+	if( !file_path || !out_info )
+	{
+		return 0;
+	}
+
+	FILE * file = fopen( file_path, "rb" );
+	if( !file )
+	{
+		return 0;
+	}
+
+	uint8_t header[ PEP_HEADER_MAX_BYTES ];
+	size_t read = fread( header, 1, sizeof( header ), file );
+	fclose( file );
+
+	return pep_peek_info( header, read, out_info );
+}
+
+////////
+
+// Animations code every frame like a pep, except the model is only reset
+// on keyframes, so frame N is predicted from everything since the last
+// keyframe. Each frame still gets its own range coder, so it starts at a
+// byte offset, and a seek only decodes forward from the keyframe before it.
+// Delta animations code only the rectangle that changed since the previous
+// frame, behind varints for its x, y, width and height (keyframes are coded
+// whole). There every symbol's context is the symbol that was at the same
+// place in the previous frame, instead of the symbol before it, so the
+// unchanged pixels inside the rectangle cost next to nothing.
+
+static inline uint8_t _pep_is_keyframe( const pep_animation* const in_animation, const uint32_t frame )
+{
+	return frame == 0 || ( in_animation->keyframe_interval != 0 && frame % in_animation->keyframe_interval == 0 );
+}
+
+// One frame as a pep, its bytes pointing into the animation's.
+static inline pep _pep_animation_frame( const pep_animation* const in_animation, const uint32_t frame )
+{
+	pep frame_pep = in_animation->image;
+	frame_pep.bytes = in_animation->image.bytes + in_animation->frame_offsets[ frame ];
+	frame_pep.bytes_size = in_animation->frame_offsets[ frame + 1 ] - in_animation->frame_offsets[ frame ];
+	return frame_pep;
+}
+
+// The bounding box of the pixels that differ between two frames, as
+// { x, y, width, height } (all 0 when nothing changed).
+static inline void _pep_changed_region( const uint32_t* const previous, const uint32_t* const current, const uint32_t width, const uint32_t height, uint32_t out_region[ 4 ] )
+{
+	uint32_t left = width, right = 0, top = height, bottom = 0;
+	for( uint32_t y = 0; y < height; y++ )
+	{
+		const uint32_t* const a = previous + ( size_t )y * width;
+		const uint32_t* const b = current + ( size_t )y * width;
+		uint32_t first = 0;
+		while( first < width && a[ first ] == b[ first ] ) first++;
+		if( first == width ) continue;
+
+		uint32_t last = width - 1;
+		while( a[ last ] == b[ last ] ) last--;
+
+		if( first < left ) left = first;
+		if( last + 1 > right ) right = last + 1;
+		if( top == height ) top = y;
+		bottom = y + 1;
+	}
+
+	if( top == height )
+	{
+		memset( out_region, 0, 4 * sizeof( uint32_t ) );
+		return;
+	}
+	out_region[ 0 ] = left;
+	out_region[ 1 ] = top;
+	out_region[ 2 ] = right - left;
+	out_region[ 3 ] = bottom - top;
+}
+
+static inline void _pep_copy_region( const uint32_t* const in_pixels, const uint32_t width, const uint32_t region[ 4 ], uint32_t* out_pixels )
+{
+	for( uint32_t row = 0; row < region[ 3 ]; row++, out_pixels += region[ 2 ] )
+	{
+		memcpy( out_pixels, in_pixels + ( size_t )( region[ 1 ] + row ) * width + region[ 0 ], region[ 2 ] * sizeof( uint32_t ) );
+	}
+}
+
+// Packs the palette indices of in_pixels into byte-symbols, the same way
+// _pep_encode_pixels() does.
+static inline void _pep_pack_symbols( const uint32_t* const in_pixels, const uint64_t pixels_area, const uint32_t palette[ 256 ], const uint16_t palette_count, uint8_t* out_symbols )
+{
+	const uint16_t radix = PEP_INDEX_RADIX( palette_count );
+	const uint8_t indices_per_byte = _pep_indices_per_byte( palette_count );
+	for( uint64_t i = 0; i < pixels_area; i += indices_per_byte )
+	{
+		uint8_t symbol = 0;
+		uint16_t digit_place = 1;
+		for( uint64_t p = i; p < i + indices_per_byte && p < pixels_area; p++ )
+		{
+			uint16_t index = 0;
+			while( index < palette_count && in_pixels[ p ] != palette[ index ] )
+			{
+				index++;
+			}
+			symbol += index * digit_place;
+			digit_place *= radix;
+		}
+		*out_symbols++ = symbol;
+	}
+}
+
+// Codes the region of current that changed since previous (see
+// _pep_changed_region()), behind its { x, y, width, height }.
+// region_pixels and context_symbols need room for a whole frame.
+// Returns 0 when out of memory
+static inline uint8_t _pep_encode_changes( const uint32_t* const previous, const uint32_t* const current, const uint32_t width, const uint32_t region[ 4 ], const uint32_t palette[ 256 ], const uint16_t palette_count, _pep_model* const model, uint32_t* const region_pixels, uint8_t* const context_symbols, uint8_t** const io_bytes, size_t* const io_capacity, size_t* const io_size )
+{
+	if( *io_capacity - *io_size < 4 * 10 )
+	{
+		const size_t capacity = *io_capacity * 2 + 4 * 10;
+		uint8_t* const grown = ( uint8_t* )PEP_REALLOC( *io_bytes, capacity );
+		if( grown == NULL ) return 0;
+		*io_bytes = grown;
+		*io_capacity = capacity;
+	}
+	for( uint8_t i = 0; i < 4; i++ )
+	{
+		*io_size += _pep_write_varint( *io_bytes + *io_size, region[ i ] );
+	}
+
+	const uint64_t region_area = ( uint64_t )region[ 2 ] * region[ 3 ];
+	if( region_area == 0 ) return 1;
+
+	// ( the previous frame's pixels only have to become symbols, so
+	// region_pixels holds them first )
+	_pep_copy_region( previous, width, region, region_pixels );
+	_pep_pack_symbols( region_pixels, region_area, palette, palette_count, context_symbols );
+	_pep_copy_region( current, width, region, region_pixels );
+	return _pep_encode_pixels( region_pixels, region_area, palette, palette_count, model, context_symbols, io_bytes, io_capacity, io_size );
+}
+
+// Decodes the player's frame of a delta animation into player->indices:
+// a keyframe whole, otherwise only the region that changed, which is
+// what out_region gets.
+// Returns 0 on corrupt data
+static inline uint8_t _pep_animation_decode_delta( pep_animation_player* const player, uint32_t out_region[ 4 ] )
+{
+	const pep_animation* const in_animation = player->animation;
+	const uint32_t width = in_animation->image.width;
+	const uint32_t height = in_animation->image.height;
+	pep frame = _pep_animation_frame( in_animation, player->frame );
+	const uint8_t keyframe = _pep_is_keyframe( in_animation, player->frame );
+
+	out_region[ 0 ] = 0;
+	out_region[ 1 ] = 0;
+	out_region[ 2 ] = width;
+	out_region[ 3 ] = height;
+	if( !keyframe )
+	{
+		const uint8_t* bytes_ref = frame.bytes;
+		const uint8_t* const bytes_end = frame.bytes + frame.bytes_size;
+		uint64_t region[ 4 ];
+		for( uint8_t i = 0; i < 4; i++ )
+		{
+			if( !_pep_read_varint( &bytes_ref, bytes_end, &region[ i ] ) ) return 0;
+		}
+		if( region[ 0 ] > width || region[ 2 ] > width - region[ 0 ] || region[ 1 ] > height || region[ 3 ] > height - region[ 1 ] ) return 0;
+
+		for( uint8_t i = 0; i < 4; i++ )
+		{
+			out_region[ i ] = ( uint32_t )region[ i ];
+		}
+		if( region[ 2 ] == 0 || region[ 3 ] == 0 ) return 1;
+
+		frame.bytes_size -= ( uint64_t )( bytes_ref - frame.bytes );
+		frame.bytes += bytes_ref - frame.bytes;
+	}
+
+	uint8_t unpacked[ 256 ][ 8 ];
+	_pep_decoder decoder;
+	_pep_decoder_init( &decoder, &frame, player->model, keyframe );
+	_pep_unpacked_indices( decoder.palette_count, unpacked );
+	decoder.unpacked = ( const uint8_t( * )[ 8 ] )unpacked;
+
+	if( keyframe )
+	{
+		_pep_decode_indices( &decoder, player->indices, width * height );
+		return !player->model->failed;
+	}
+
+	// ( a symbol's context is packed from the indices it's about to
+	// replace, exactly like _pep_pack_symbols() did for the encoder )
+	const uint16_t radix = PEP_INDEX_RADIX( decoder.palette_count );
+	const uint8_t indices_per_byte = decoder.indices_per_byte;
+	const uint32_t region_width = out_region[ 2 ];
+	uint8_t* places[ 8 ];
+	uint8_t* row = player->indices + ( size_t )out_region[ 1 ] * width + out_region[ 0 ];
+	uint32_t x = 0;
+	uint64_t remaining = ( uint64_t )region_width * out_region[ 3 ];
+	while( remaining > 0 )
+	{
+		const uint8_t count = ( remaining < indices_per_byte ) ? ( uint8_t )remaining : indices_per_byte;
+		uint32_t context = 0;
+		uint32_t place = 1;
+		for( uint8_t i = 0; i < count; i++ )
+		{
+			places[ i ] = row + x;
+			context += *places[ i ] * place;
+			place *= radix;
+			if( ++x == region_width )
+			{
+				x = 0;
+				row += width;
+			}
+		}
+
+		decoder.context_id = context;
+		const uint8_t* const symbol_indices = unpacked[ _pep_decode_symbol( &decoder ) ];
+		for( uint8_t i = 0; i < count; i++ )
+		{
+			*places[ i ] = symbol_indices[ i ];
+		}
+		remaining -= count;
+	}
+
+	return !player->model->failed;
+}
+
+// Like pep_compress(), but for frame_count frames of the same size, that get
+// one palette (all of them can have at most 256 colors together).
+// keyframe_interval trades size for seeking: the model restarts every N
+// frames (0 means only on the first one).
+static inline pep_animation pep_compress_animation( const uint32_t* const* in_frames, const uint32_t frame_count, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_channel_bits in_channel_bits, const uint32_t keyframe_interval )
+{
+	return _pep_compress_animation( in_frames, frame_count, width, height, in_format, in_channel_bits, keyframe_interval, 0 );
+}
+
+// Like pep_compress_animation(), but the frames between keyframes only code
+// the rectangle that changed since the frame before, predicted from that
+// frame. Best for animations where most of the image stays put.
+static inline pep_animation pep_compress_animation_delta( const uint32_t* const* in_frames, const uint32_t frame_count, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_channel_bits in_channel_bits, const uint32_t keyframe_interval )
+{
+	return _pep_compress_animation( in_frames, frame_count, width, height, in_format, in_channel_bits, keyframe_interval, 1 );
+}
+
+static inline pep_animation _pep_compress_animation( const uint32_t* const* in_frames, const uint32_t frame_count, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_channel_bits in_channel_bits, const uint32_t keyframe_interval, const uint8_t delta )
+{
+	pep_animation out_animation = { 0 };
+	const uint64_t pixels_area = ( uint64_t )width * height;
+
+	if( in_frames == NULL || frame_count == 0 || pixels_area == 0 || in_format > pep_argb ) return out_animation;
+
+	pep* const image = &out_animation.image;
+	uint16_t palette_count = 0;
+	for( uint32_t f = 0; f < frame_count; f++ )
+	{
+		if( in_frames[ f ] == NULL || !_pep_build_palette( in_frames[ f ], pixels_area, image->palette, &palette_count ) )
+		{
+			pep_animation empty = { 0 };
+			return empty;
+		}
+	}
+
+	image->palette_size = ( uint8_t )palette_count;
+	image->width = width;
+	image->height = height;
+	image->format = in_format;
+	image->channel_bits = in_channel_bits;
+	out_animation.frame_count = frame_count;
+	out_animation.keyframe_interval = keyframe_interval;
+	out_animation.delta = delta;
+
+	out_animation.frame_offsets = ( uint64_t* )PEP_MALLOC( ( ( size_t )frame_count + 1 ) * sizeof( uint64_t ) );
+	_pep_model* const model = ( _pep_model* )PEP_MALLOC( sizeof( _pep_model ) );
+	if( model != NULL ) _pep_model_init( model );
+	uint32_t* const region_pixels = delta ? ( uint32_t* )PEP_MALLOC( ( size_t )pixels_area * sizeof( uint32_t ) ) : NULL;
+	uint8_t* const context_symbols = delta ? ( uint8_t* )PEP_MALLOC( ( size_t )pixels_area ) : NULL;
+	uint8_t success = ( out_animation.frame_offsets != NULL && model != NULL && ( !delta || ( region_pixels != NULL && context_symbols != NULL ) ) );
+
+	size_t bytes_capacity = 0;
+	size_t bytes_size = 0;
+	if( success )
+	{
+		for( uint32_t f = 0; f < frame_count && success; f++ )
+		{
+			const uint8_t keyframe = _pep_is_keyframe( &out_animation, f );
+			if( keyframe ) _pep_model_reset( model );
+			out_animation.frame_offsets[ f ] = bytes_size;
+			if( delta && !keyframe )
+			{
+				uint32_t region[ 4 ];
+				_pep_changed_region( in_frames[ f - 1 ], in_frames[ f ], width, height, region );
+				success = _pep_encode_changes( in_frames[ f - 1 ], in_frames[ f ], width, region, image->palette, palette_count, model, region_pixels, context_symbols, &image->bytes, &bytes_capacity, &bytes_size );
+			}
+			else
+			{
+				success = _pep_encode_pixels( in_frames[ f ], pixels_area, image->palette, palette_count, model, NULL, &image->bytes, &bytes_capacity, &bytes_size );
+			}
+		}
+		out_animation.frame_offsets[ frame_count ] = bytes_size;
+	}
+
+	if( model != NULL ) _pep_model_free( model );
+	PEP_FREE( model );
+	PEP_FREE( region_pixels );
+	PEP_FREE( context_symbols );
+	if( !success )
+	{
+		PEP_FREE( image->bytes );
+		PEP_FREE( out_animation.frame_offsets );
+		pep_animation empty = { 0 };
+		return empty;
+	}
+
+	image->bytes_size = bytes_size;
+	image->bytes = ( uint8_t* )PEP_REALLOC( image->bytes, bytes_size );
+
+	return out_animation;
+}
+
+static inline void pep_free_animation( pep_animation* in_animation )
+{
+	if( in_animation )
+	{
+		pep_free( &in_animation->image );
+		PEP_FREE( in_animation->frame_offsets );
+		in_animation->frame_offsets = NULL;
+		in_animation->frame_count = 0;
+	}
+}
+
+// Starts decoding in_animation from its first frame. The player owns a
+// model that stays warm across pep_animation_next() calls, free it with
+// pep_animation_stop().
+// Returns 0 on failure, 1 on success
+static inline uint8_t pep_animation_play( const pep_animation* const in_animation, pep_animation_player* const out_player )
+{
+	if( !in_animation || !out_player || !in_animation->image.bytes || !in_animation->frame_offsets || in_animation->frame_count == 0 ) return 0;
+
+	out_player->animation = in_animation;
+	out_player->frame = 0;
+	out_player->write_all = 1;
+	out_player->indices = NULL;
+	out_player->column = NULL;
+	out_player->model = ( _pep_model* )PEP_MALLOC( sizeof( _pep_model ) );
+	if( out_player->model == NULL ) return 0;
+
+	_pep_model_init( out_player->model );
+
+	if( in_animation->delta )
+	{
+		// ( with 8 bytes of slack for _pep_decode_indices(), and the column after them )
+		const uint32_t width = in_animation->image.width;
+		const uint32_t height = in_animation->image.height;
+		out_player->indices = ( uint8_t* )PEP_MALLOC( ( size_t )width * height + 8 + ( width > height ? width : height ) );
+		if( out_player->indices == NULL )
+		{
+			pep_animation_stop( out_player );
+			return 0;
+		}
+		out_player->column = out_player->indices + ( size_t )width * height + 8;
+	}
+	return 1;
+}
+
+// Decodes the next frame into target, like pep_decompress_into().
+// A delta animation only writes the region that changed, so target has to
+// still hold the frame before (after a play or seek the whole frame is written).
+// Returns 0 after the last frame or on failure, 1 on success
+static inline uint8_t pep_animation_next( pep_animation_player* const player, const pep_target* const target )
+{
+	if( !player || !player->model || !target ) return 0;
+
+	const pep_animation* const in_animation = player->animation;
+	if( player->frame >= in_animation->frame_count ) return 0;
+
+	const pep frame = _pep_animation_frame( in_animation, player->frame );
+	const uint8_t scale = target->upscale ? target->upscale : 1;
+	const uint8_t rotate = ( target->orientation & pep_rotate_90 ) != 0;
+	const uint32_t out_width = ( uint32_t )( rotate ? frame.height : frame.width ) * scale;
+	const uint32_t out_height = ( uint32_t )( rotate ? frame.width : frame.height ) * scale;
+	if( target->pixels == NULL || pep_bytes_per_pixel( target->format ) == 0 ) return 0;
+
+	if( in_animation->delta )
+	{
+		uint32_t region[ 4 ];
+		if( !_pep_animation_decode_delta( player, region ) ) return 0;
+		if( player->write_all )
+		{
+			region[ 0 ] = 0;
+			region[ 1 ] = 0;
+			region[ 2 ] = frame.width;
+			region[ 3 ] = frame.height;
+		}
+
+		_pep_canvas canvas;
+		_pep_canvas_init( &canvas, &frame, target, out_width, out_height, 0, 0, -1 );
+		_pep_canvas_region( &canvas, player->indices, frame.width, frame.height, region, target->orientation, player->column );
+		player->write_all = 0;
+		player->frame++;
+		return 1;
+	}
+
+	if( _pep_is_keyframe( in_animation, player->frame ) )
+	{
+		_pep_model_reset( player->model );
+	}
+	if( !_pep_decompress_canvas( &frame, target, out_width, out_height, 0, 0, -1, player->model ) ) return 0;
+
+	player->frame++;
+	return 1;
+}
+
+// Makes frame the next one pep_animation_next() decodes. The frames in
+// between it and the keyframe before it are decoded without any output,
+// just to bring the model (and a delta animation's indices) up to date.
+// Returns 0 on failure, 1 on success
+static inline uint8_t pep_animation_seek( pep_animation_player* const player, const uint32_t frame )
+{
+	if( !player || !player->model ) return 0;
+
+	const pep_animation* const in_animation = player->animation;
+	if( frame >= in_animation->frame_count ) return 0;
+
+	const uint32_t keyframe = in_animation->keyframe_interval ? frame - frame % in_animation->keyframe_interval : 0;
+	if( player->frame > frame || player->frame < keyframe ) player->frame = keyframe;
+
+	const uint16_t palette_count = in_animation->image.palette_size ? in_animation->image.palette_size : 256;
+	const uint8_t indices_per_byte = _pep_indices_per_byte( palette_count );
+	const uint64_t symbols_count = ( ( uint64_t )in_animation->image.width * in_animation->image.height + indices_per_byte - 1 ) / indices_per_byte;
+	player->write_all = 1;
+	while( player->frame < frame )
+	{
+		if( in_animation->delta )
+		{
+			uint32_t region[ 4 ];
+			if( !_pep_animation_decode_delta( player, region ) ) return 0;
+			player->frame++;
+			continue;
+		}
+
+		const pep skipped = _pep_animation_frame( in_animation, player->frame );
+		if( _pep_is_keyframe( in_animation, player->frame ) ) _pep_model_reset( player->model );
+
+		_pep_decoder decoder;
+		_pep_decoder_init( &decoder, &skipped, player->model, 0 );
+		for( uint64_t i = 0; i < symbols_count; i++ )
+		{
+			_pep_decode_symbol( &decoder );
+		}
+		if( player->model->failed ) return 0;
+		player->frame++;
+	}
+
+	return 1;
+}
+
+static inline void pep_animation_stop( pep_animation_player* const player )
+{
+	if( player )
+	{
+		if( player->model ) _pep_model_free( player->model );
+		PEP_FREE( player->model );
+		PEP_FREE( player->indices );
+		player->model = NULL;
+		player->indices = NULL;
+		player->column = NULL;
+	}
+}
+
+// An animation is serialized as "PEPA", varints for the frame count and the
+// keyframe interval, a byte for delta, varints for every frame's size, and
+// then its image as a regular serialized pep (with all frames as its bytes).
+static inline uint8_t* pep_serialize_animation( const pep_animation* const in_animation, uint64_t* const out_size )
+{
+	*out_size = 0;
+	if( !in_animation || !in_animation->frame_offsets || in_animation->frame_count == 0 ) return NULL;
+
+	const size_t image_size = pep_serialized_size( &in_animation->image );
+	if( image_size == 0 ) return NULL;
+
+	const size_t table_size = 4 + 1 + 10 * ( ( size_t )in_animation->frame_count + 2 );
+	uint8_t* out_bytes = ( uint8_t* )PEP_MALLOC( table_size + image_size );
+	if( out_bytes == NULL ) return NULL;
+
+	uint8_t* out_bytes_ref = out_bytes;
+	memcpy( out_bytes_ref, "PEPA", 4 );
+	out_bytes_ref += 4;
+	out_bytes_ref += _pep_write_varint( out_bytes_ref, in_animation->frame_count );
+	out_bytes_ref += _pep_write_varint( out_bytes_ref, in_animation->keyframe_interval );
+	*out_bytes_ref++ = in_animation->delta;
+	for( uint32_t f = 0; f < in_animation->frame_count; f++ )
+	{
+		out_bytes_ref += _pep_write_varint( out_bytes_ref, in_animation->frame_offsets[ f + 1 ] - in_animation->frame_offsets[ f ] );
+	}
+	out_bytes_ref += pep_serialize_into( &in_animation->image, out_bytes_ref, image_size );
+
+	*out_size = ( uint64_t )( out_bytes_ref - out_bytes );
+	return out_bytes;
+}
+
+static inline pep_animation pep_deserialize_animation( const uint8_t* const in_bytes, const uint64_t in_bytes_size )
+{
+	pep_animation out_animation = { 0 };
+
+	if( !in_bytes || in_bytes_size < 4 || memcmp( in_bytes, "PEPA", 4 ) != 0 ) return out_animation;
+
+	const uint8_t* bytes_ref = in_bytes + 4;
+	const uint8_t* const bytes_end = in_bytes + in_bytes_size;
+	uint64_t frame_count = 0;
+	uint64_t keyframe_interval = 0;
+	if( !_pep_read_varint( &bytes_ref, bytes_end, &frame_count ) || !_pep_read_varint( &bytes_ref, bytes_end, &keyframe_interval ) ) return out_animation;
+	if( bytes_ref == bytes_end || *bytes_ref > 1 ) return out_animation;
+	const uint8_t delta = *bytes_ref++;
+
+	// ( every frame's size takes at least a byte )
+	if( frame_count == 0 || frame_count > ( uint64_t )( bytes_end - bytes_ref ) || frame_count > UINT32_MAX || keyframe_interval > UINT32_MAX ) return out_animation;
+
+	uint64_t* const frame_offsets = ( uint64_t* )PEP_MALLOC( ( ( size_t )frame_count + 1 ) * sizeof( uint64_t ) );
+	if( frame_offsets == NULL ) return out_animation;
+
+	frame_offsets[ 0 ] = 0;
+	for( uint64_t f = 0; f < frame_count; f++ )
+	{
+		uint64_t frame_size = 0;
+		if( !_pep_read_varint( &bytes_ref, bytes_end, &frame_size ) || frame_size > in_bytes_size )
+		{
+			PEP_FREE( frame_offsets );
+			return out_animation;
+		}
+		frame_offsets[ f + 1 ] = frame_offsets[ f ] + frame_size;
+	}
+
+	pep image = pep_deserialize( bytes_ref, ( uint64_t )( bytes_end - bytes_ref ) );
+	if( image.bytes == NULL || image.bytes_size != frame_offsets[ frame_count ] )
+	{
+		pep_free( &image );
+		PEP_FREE( frame_offsets );
+		return out_animation;
+	}
+
+	out_animation.image = image;
+	out_animation.frame_offsets = frame_offsets;
+	out_animation.frame_count = ( uint32_t )frame_count;
+	out_animation.keyframe_interval = ( uint32_t )keyframe_interval;
+	out_animation.delta = delta;
+	return out_animation;
+}
+
+// Saves an animation into a file (e.g. "walk.pepa").
+// Returns 0 on failure, 1 on success
+static inline uint8_t pep_save_animation( const pep_animation* const in_animation, const char* const file_path )
+{
+	if( !in_animation || !file_path )
+	{
+		return 0;
+	}
+
+	uint64_t bytes_size = 0;
+	uint8_t* bytes = pep_serialize_animation( in_animation, &bytes_size );
+
+	if( !bytes || bytes_size == 0 )
+	{
+		return 0;
+	}
+
+	FILE * file = fopen( file_path, "wb" );
+	if( !file )
+	{
+		PEP_FREE( bytes );
+		return 0;
+	}
+
+	size_t written = fwrite( bytes, 1, ( size_t )bytes_size, file );
+
+	fclose( file );
+	PEP_FREE( bytes );
+
+	return written == bytes_size;
+}
+
+// Loads an animation file into the returned pep_animation
+static inline pep_animation pep_load_animation( const char* const file_path )
+{
+	pep_animation out_animation = { 0 };
+
+	if( !file_path )
+	{
+		return out_animation;
+	}
+
+	FILE * file = fopen( file_path, "rb" );
+	if( !file )
+	{
+		return out_animation;
+	}
+
+	fseek( file, 0, SEEK_END );
+	long file_size = ftell( file );
+	fseek( file, 0, SEEK_SET );
+
+	if( file_size <= 0 )
+	{
+		fclose( file );
+		return out_animation;
+	}
+
+	uint8_t* bytes = ( uint8_t* )PEP_MALLOC( file_size );
+	if( !bytes )
+	{
+		fclose( file );
+		return out_animation;
+	}
+
+	size_t read = fread( bytes, 1, file_size, file );
+	fclose( file );
+
+	if( read == ( size_t )file_size )
+	{
+		out_animation = pep_deserialize_animation( bytes, ( uint64_t )read );
+	}
+	PEP_FREE( bytes );
+
+	return out_animation;
+}
+
+////////
+
+// A stream records frames as they come (e.g. gameplay capture) into a delta
+// animation. Everything carries over from one frame to the next: the model,
+// the palette, the last frame and the output buffer, so a frame only costs
+// finding what changed, checking its colors and coding it.
+// The palette and packing can't change once frames are coded, so max_colors
+// entries are reserved up front, and filled in as new colors show up.
+// At 320x180 (16 colors) a keyframe takes about 1ms on one core, and a
+// static screen only costs the comparison, about 0.05ms.
+// _pep_changed_region() keeps a single bounding box, so changes scattered
+// over the screen grow it to the whole frame, and every such frame is coded
+// in full through the delta path: 30 scattered 16x16 changes per frame at
+// 320x180 (16 colors) measured 6.6ms on average and 10.2ms at worst (-O2),
+// against a budget of 16.6ms per frame at 60 fps.
+
+static inline void _pep_stream_free_buffers( pep_stream* const stream )
+{
+	if( stream->model ) _pep_model_free( stream->model );
+	PEP_FREE( stream->model );
+	PEP_FREE( stream->previous );
+	PEP_FREE( stream->region_pixels );
+	PEP_FREE( stream->context_symbols );
+	stream->model = NULL;
+	stream->previous = NULL;
+	stream->region_pixels = NULL;
+	stream->context_symbols = NULL;
+}
+
+// Starts a stream of width * height frames in in_format, with at most
+// max_colors colors (1-256) over all of them, and a keyframe every
+// keyframe_interval frames (0 means only the first one).
+// Returns 0 on failure, 1 on success
+static inline uint8_t pep_stream_begin( pep_stream* const out_stream, const uint16_t width, const uint16_t height, const pep_format in_format, const pep_channel_bits in_channel_bits, const uint16_t max_colors, const uint32_t keyframe_interval )
+{
+	if( !out_stream ) return 0;
+	memset( out_stream, 0, sizeof( pep_stream ) );
+
+	const uint64_t pixels_area = ( uint64_t )width * height;
+	if( pixels_area == 0 || pixels_area > SIZE_MAX / sizeof( uint32_t ) || in_format > pep_argb || max_colors == 0 || max_colors > 256 ) return 0;
+
+	pep_animation* const animation = &out_stream->animation;
+	animation->image.width = width;
+	animation->image.height = height;
+	animation->image.format = in_format;
+	animation->image.channel_bits = in_channel_bits;
+	animation->image.palette_size = ( uint8_t )max_colors;
+	animation->keyframe_interval = keyframe_interval;
+	animation->delta = 1;
+	out_stream->palette_count = max_colors;
+	out_stream->frames_capacity = 64;
+
+	animation->frame_offsets = ( uint64_t* )PEP_MALLOC( ( out_stream->frames_capacity + 1 ) * sizeof( uint64_t ) );
+	out_stream->model = ( _pep_model* )PEP_MALLOC( sizeof( _pep_model ) );
+	if( out_stream->model ) _pep_model_init( out_stream->model );
+	out_stream->previous = ( uint32_t* )PEP_MALLOC( ( size_t )pixels_area * sizeof( uint32_t ) );
+	out_stream->region_pixels = ( uint32_t* )PEP_MALLOC( ( size_t )pixels_area * sizeof( uint32_t ) );
+	out_stream->context_symbols = ( uint8_t* )PEP_MALLOC( ( size_t )pixels_area );
+	if( !animation->frame_offsets || !out_stream->model || !out_stream->previous || !out_stream->region_pixels || !out_stream->context_symbols )
+	{
+		_pep_stream_free_buffers( out_stream );
+		pep_free_animation( animation );
+		return 0;
+	}
+
+	animation->frame_offsets[ 0 ] = 0;
+	return 1;
+}
+
+// Codes in_pixels (width * height, in the stream's in_format) as the next frame.
+// Returns 0 on failure, 1 on success. A frame that would take the stream
+// past max_colors is left out, and the stream can go on; when out of memory
+// the stream stops taking frames (what it has is still in pep_stream_end())
+static inline uint8_t pep_stream_push( pep_stream* const stream, const uint32_t* const in_pixels )
+{
+	if( !stream || !stream->model || !in_pixels ) return 0;
+
+	pep_animation* const animation = &stream->animation;
+	pep* const image = &animation->image;
+	const uint32_t width = image->width;
+	const uint32_t height = image->height;
+	const uint32_t frame = animation->frame_count;
+	if( frame == UINT32_MAX ) return 0;
+
+	const uint8_t keyframe = _pep_is_keyframe( animation, frame );
+	uint32_t region[ 4 ] = { 0, 0, width, height };
+	if( !keyframe ) _pep_changed_region( stream->previous, in_pixels, width, height, region );
+
+	// ( new colors can only be in the region )
+	const uint16_t palette_used = stream->palette_used;
+	for( uint32_t row = region[ 1 ]; row < region[ 1 ] + region[ 3 ]; row++ )
+	{
+		if( !_pep_build_palette( in_pixels + ( size_t )row * width + region[ 0 ], region[ 2 ], image->palette, &stream->palette_used ) || stream->palette_used > stream->palette_count )
+		{
+			memset( &image->palette[ palette_used ], 0, ( 256 - palette_used ) * sizeof( uint32_t ) );
+			stream->palette_used = palette_used;
+			return 0;
+		}
+	}
+
+	if( frame == stream->frames_capacity )
+	{
+		uint64_t* const grown = ( uint64_t* )PEP_REALLOC( animation->frame_offsets, ( ( size_t )frame * 2 + 1 ) * sizeof( uint64_t ) );
+		if( grown == NULL ) return 0;
+		animation->frame_offsets = grown;
+		stream->frames_capacity = frame * 2;
+	}
+
+	size_t bytes_size = ( size_t )image->bytes_size;
+	uint8_t success = 0;
+	if( keyframe )
+	{
+		_pep_model_reset( stream->model );
+		success = _pep_encode_pixels( in_pixels, ( uint64_t )width * height, image->palette, stream->palette_count, stream->model, NULL, &image->bytes, &stream->bytes_capacity, &bytes_size );
+	}
+	else
+	{
+		success = _pep_encode_changes( stream->previous, in_pixels, width, region, image->palette, stream->palette_count, stream->model, stream->region_pixels, stream->context_symbols, &image->bytes, &stream->bytes_capacity, &bytes_size );
+	}
+
+	// ( the model has seen part of the frame, so no later frame can be coded )
+	if( !success )
+	{
+		_pep_stream_free_buffers( stream );
+		return 0;
+	}
+
+	image->bytes_size = bytes_size;
+	animation->frame_offsets[ frame + 1 ] = bytes_size;
+	animation->frame_count++;
+
+	for( uint32_t row = region[ 1 ]; row < region[ 1 ] + region[ 3 ]; row++ )
+	{
+		const size_t offset = ( size_t )row * width + region[ 0 ];
+		memcpy( stream->previous + offset, in_pixels + offset, region[ 2 ] * sizeof( uint32_t ) );
+	}
+
+	return 1;
+}
+
+// Stops the stream and returns everything it recorded (free it with
+// pep_free_animation()). image.bytes is NULL when no frame was recorded.
+static inline pep_animation pep_stream_end( pep_stream* const stream )
+{
+	pep_animation out_animation = { 0 };
+	if( !stream ) return out_animation;
+
+	_pep_stream_free_buffers( stream );
+	if( stream->animation.frame_count == 0 )
+	{
+		pep_free_animation( &stream->animation );
+	}
+	else
+	{
+		// the indices were coded for all palette_count slots, so the palette
+		// can't be trimmed, but the unused ones repeat the last color so they
+		// don't read as transparent and cost an alpha channel when serialized
+		for( uint16_t i = stream->palette_used; i < stream->palette_count; i++ )
+		{
+			stream->animation.image.palette[ i ] = stream->animation.image.palette[ stream->palette_used - 1 ];
+		}
+
+		out_animation = stream->animation;
+		uint8_t* const shrunk = ( uint8_t* )PEP_REALLOC( out_animation.image.bytes, ( size_t )out_animation.image.bytes_size );
+		if( shrunk ) out_animation.image.bytes = shrunk;
+	}
+
+	memset( stream, 0, sizeof( pep_stream ) );
+	return out_animation;
+}
+
+////////
+
+// A pack holds many assets in one file, so loading them costs one open and
+// one mmap instead of a pep_load() each. Its index is fixed-size entries
+// sorted by the 64bit FNV-1a hash of every name, so a lookup is a binary
+// search that only touches the index, and pep_pack_view() decodes an asset
+// straight out of the pack without copying it. Names aren't stored, so two
+// names can't share a hash (pep_pack_build() refuses them).
+// Sprites of one game tend to share a master palette, which a small sprite
+// spends more bytes on than on its pixels, so a pack can also hold shared
+// palettes (see pep_pack_palette) that its assets refer to by id.
+
+static inline void _pep_put_be( uint8_t* const out_bytes, const uint64_t value, const uint8_t bytes )
+{
+	for( uint8_t i = 0; i < bytes; i++ )
+	{
+		out_bytes[ i ] = ( uint8_t )( value >> ( 8 * ( bytes - 1 - i ) ) );
+	}
+}
+
+static inline uint64_t _pep_get_be( const uint8_t* const in_bytes, const uint8_t bytes )
+{
+	uint64_t value = 0;
+	for( uint8_t i = 0; i < bytes; i++ )
+	{
+		value = ( value << 8 ) | in_bytes[ i ];
+	}
+	return value;
+}
+
+// Orders { hash, asset } pairs by hash.
+static inline int _pep_pack_compare( const void* a, const void* b )
+{
+	const uint64_t hash_a = *( const uint64_t* )a;
+	const uint64_t hash_b = *( const uint64_t* )b;
+	return ( hash_a > hash_b ) - ( hash_a < hash_b );
+}
+
+static inline uint64_t pep_pack_hash( const char* const name )
+{
+	uint64_t hash = 14695981039346656037ull;
+	for( const uint8_t* c = ( const uint8_t* )name; *c; c++ )
+	{
+		hash = ( hash ^ *c ) * 1099511628211ull;
+	}
+	return hash;
+}
+
+// The shared palette in_pep can use: the first one in its format that has
+// all of its colors.
+// Returns PEP_PACK_OWN_PALETTE when there's none
+static inline uint16_t _pep_pack_palette_of( const pep* const in_pep, const pep_pack_palette* const palettes, const uint16_t palettes_count )
+{
+	const uint16_t palette_count = in_pep->palette_size ? in_pep->palette_size : 256;
+	for( uint16_t p = 0; p < palettes_count; p++ )
+	{
+		const pep_pack_palette* const palette = &palettes[ p ];
+		if( palette->format != in_pep->format || palette->count < palette_count ) continue;
+
+		uint16_t found = 0;
+		for( uint16_t c = 0; c < palette_count; c++ )
+		{
+			uint16_t i = 0;
+			while( i < palette->count && palette->colors[ i ] != in_pep->palette[ c ] ) i++;
+			if( i == palette->count ) break;
+			found++;
+		}
+		if( found == palette_count ) return p;
+	}
+	return PEP_PACK_OWN_PALETTE;
+}
+
+// Codes in_pep's pixels again with a shared palette, appending them to
+// *io_bytes like _pep_encode_pixels() (the model is left as it is).
+// Returns 0 on failure, 1 on success
+static inline uint8_t _pep_pack_encode_shared( const pep* const in_pep, const pep_pack_palette* const palette, _pep_model* const model, uint8_t** const io_bytes, size_t* const io_capacity, size_t* const io_size )
+{
+	uint32_t* const pixels = pep_decompress( in_pep, in_pep->format, 0, 0 );
+	if( pixels == NULL ) return 0;
+
+	const uint8_t encoded = _pep_encode_pixels( pixels, ( uint64_t )in_pep->width * in_pep->height, palette->colors, palette->count, model, NULL, io_bytes, io_capacity, io_size );
+	PEP_FREE( pixels );
+	return encoded;
+}
+
+// Moves every asset whose colors all fit a shared palette onto it. A
+// palette with a prior first has its model trained on all of its assets,
+// one after another, and then each of them is coded from that prior when
+// that's smaller than from scratch. An asset keeps its own palette
+// whenever that's smaller anyway.
+// Returns 0 on failure, 1 on success
+static inline uint8_t _pep_pack_share( const pep* const peps, const uint32_t count, const pep_pack_palette* const palettes, const uint16_t palettes_count, _pep_model* const model, _pep_pack_asset* const assets, uint8_t** const priors, uint32_t* const prior_sizes )
+{
+	for( uint32_t i = 0; i < count; i++ )
+	{
+		assets[ i ].palette_id = _pep_pack_palette_of( &peps[ i ], palettes, palettes_count );
+	}
+
+	uint8_t* scratch = NULL;
+	size_t scratch_capacity = 0;
+	uint8_t success = 1;
+	for( uint16_t p = 0; success && p < palettes_count; p++ )
+	{
+		if( !palettes[ p ].prior ) continue;
+
+		uint8_t trained = 0;
+		_pep_model_reset( model );
+		for( uint32_t i = 0; success && i < count; i++ )
+		{
+			if( assets[ i ].palette_id != p ) continue;
+
+			size_t scratch_size = 0;
+			success = _pep_pack_encode_shared( &peps[ i ], &palettes[ p ], model, &scratch, &scratch_capacity, &scratch_size );
+			trained = 1;
+		}
+		if( !success || !trained ) continue;
+
+		priors[ p ] = ( uint8_t* )PEP_MALLOC( PEP_PRIOR_MAX_BYTES );
+		success = ( priors[ p ] != NULL );
+		if( success ) prior_sizes[ p ] = _pep_model_save_prior( model, priors[ p ] );
+	}
+	PEP_FREE( scratch );
+
+	for( uint32_t i = 0; success && i < count; i++ )
+	{
+		_pep_pack_asset* const asset = &assets[ i ];
+		asset->size = pep_serialized_size( &peps[ i ] );
+		if( asset->palette_id == PEP_PACK_OWN_PALETTE ) continue;
+
+		// ( a prior that doesn't fit an asset only costs it, so it's tried
+		// both ways )
+		const uint16_t p = asset->palette_id;
+		size_t capacity = 0;
+		size_t size = 0;
+		_pep_model_reset( model );
+		success = _pep_pack_encode_shared( &peps[ i ], &palettes[ p ], model, &asset->bytes, &capacity, &size );
+		if( success && priors[ p ] != NULL )
+		{
+			uint8_t* prior_bytes = NULL;
+			size_t prior_capacity = 0;
+			size_t prior_size = 0;
+			_pep_model_load_prior( model, priors[ p ], prior_sizes[ p ] );
+			success = _pep_pack_encode_shared( &peps[ i ], &palettes[ p ], model, &prior_bytes, &prior_capacity, &prior_size );
+			if( success && prior_size < size )
+			{
+				PEP_FREE( asset->bytes );
+				asset->bytes = prior_bytes;
+				asset->prior = 1;
+				size = prior_size;
+			}
+			else PEP_FREE( prior_bytes );
+		}
+		if( success && size < asset->size )
+		{
+			asset->size = size;
+			continue;
+		}
+		PEP_FREE( asset->bytes );
+		asset->bytes = NULL;
+		asset->prior = 0;
+		asset->palette_id = PEP_PACK_OWN_PALETTE;
+	}
+	return success;
+}
+
+// Packs count peps, each under its name. The assets keep their order (so
+// ones used together stay close), only the index is sorted.
+// palettes are the palettes_count shared palettes (NULL and 0 for none),
+// an asset uses the first one that has all of its colors.
+// Returns the pack's bytes (free() them), or NULL on failure, including
+// when two names have the same hash
+static inline uint8_t* pep_pack_build( const char* const* names, const pep* const peps, const uint32_t count, const pep_pack_palette* const palettes, const uint16_t palettes_count, uint64_t* const out_size )
+{
+	*out_size = 0;
+	if( !names || !peps || count == 0 || ( uint64_t )count * PEP_PACK_ENTRY_BYTES > SIZE_MAX ) return NULL;
+	if( ( palettes_count && !palettes ) || palettes_count >= PEP_PACK_OWN_PALETTE ) return NULL;
+	for( uint16_t p = 0; p < palettes_count; p++ )
+	{
+		if( palettes[ p ].count == 0 || palettes[ p ].count > 256 || palettes[ p ].format > pep_argb ) return NULL;
+	}
+	for( uint32_t i = 0; i < count; i++ )
+	{
+		if( !names[ i ] || pep_serialized_size( &peps[ i ] ) == 0 ) return NULL;
+	}
+
+	uint64_t* const order = ( uint64_t* )PEP_MALLOC( ( size_t )count * 2 * sizeof( uint64_t ) );
+	_pep_pack_asset* const assets = ( _pep_pack_asset* )PEP_MALLOC( ( size_t )count * sizeof( _pep_pack_asset ) );
+	uint8_t** const priors = ( uint8_t** )PEP_MALLOC( ( palettes_count + 1 ) * sizeof( uint8_t* ) );
+	uint32_t* const prior_sizes = ( uint32_t* )PEP_MALLOC( ( palettes_count + 1 ) * sizeof( uint32_t ) );
+	_pep_model* const model = palettes_count ? ( _pep_model* )PEP_MALLOC( sizeof( _pep_model ) ) : NULL;
+	if( model != NULL ) _pep_model_init( model );
+	uint8_t* out_bytes = NULL;
+
+	// ( cleared before anything can fail, the cleanup frees what they point to )
+	if( assets != NULL ) memset( assets, 0, ( size_t )count * sizeof( _pep_pack_asset ) );
+	if( priors != NULL ) memset( priors, 0, ( palettes_count + 1 ) * sizeof( uint8_t* ) );
+	if( prior_sizes != NULL ) memset( prior_sizes, 0, ( palettes_count + 1 ) * sizeof( uint32_t ) );
+
+	uint8_t success = ( order != NULL && assets != NULL && priors != NULL && prior_sizes != NULL && ( model != NULL || !palettes_count ) );
+	if( success )
+	{
+		success = _pep_pack_share( peps, count, palettes, palettes_count, model, assets, priors, prior_sizes );
+	}
+
+	if( success )
+	{
+		for( uint32_t i = 0; i < count; i++ )
+		{
+			order[ i * 2 ] = pep_pack_hash( names[ i ] );
+			order[ i * 2 + 1 ] = i;
+		}
+		qsort( order, count, 2 * sizeof( uint64_t ), _pep_pack_compare );
+		for( uint32_t i = 1; i < count; i++ )
+		{
+			if( order[ i * 2 ] == order[ ( i - 1 ) * 2 ] ) success = 0;
+		}
+	}
+
+	// ( the shared palettes sit between the index and the assets )
+	uint64_t pack_size = PEP_PACK_HEADER_BYTES + ( uint64_t )count * PEP_PACK_ENTRY_BYTES + ( uint64_t )palettes_count * 8;
+	for( uint16_t p = 0; success && p < palettes_count; p++ )
+	{
+		pack_size += 7 + palettes[ p ].count * 4 + prior_sizes[ p ];
+	}
+	for( uint32_t i = 0; success && i < count; i++ )
+	{
+		assets[ i ].offset = pack_size;
+		pack_size += assets[ i ].size;
+	}
+
+	if( success && pack_size <= SIZE_MAX ) out_bytes = ( uint8_t* )PEP_MALLOC( ( size_t )pack_size );
+	if( out_bytes != NULL )
+	{
+		memcpy( out_bytes, "PEPK", 4 );
+		_pep_put_be( out_bytes + 4, count, 4 );
+		_pep_put_be( out_bytes + 8, palettes_count, 4 );
+
+		uint8_t* const palette_offsets = out_bytes + PEP_PACK_HEADER_BYTES + ( size_t )count * PEP_PACK_ENTRY_BYTES;
+		uint64_t offset = ( uint64_t )( palette_offsets - out_bytes ) + ( uint64_t )palettes_count * 8;
+		for( uint16_t p = 0; p < palettes_count; p++ )
+		{
+			const pep_pack_palette* const palette = &palettes[ p ];
+			uint8_t* record = out_bytes + offset;
+			_pep_put_be( palette_offsets + ( size_t )p * 8, offset, 8 );
+			record[ 0 ] = ( uint8_t )palette->format;
+			_pep_put_be( record + 1, palette->count, 2 );
+			record += 3;
+			for( uint16_t c = 0; c < palette->count; c++, record += 4 )
+			{
+				_pep_put_be( record, palette->colors[ c ], 4 );
+			}
+			_pep_put_be( record, prior_sizes[ p ], 4 );
+			if( prior_sizes[ p ] ) memcpy( record + 4, priors[ p ], prior_sizes[ p ] );
+			offset += 7 + palette->count * 4 + prior_sizes[ p ];
+		}
+
+		for( uint32_t i = 0; i < count; i++ )
+		{
+			const _pep_pack_asset* const asset = &assets[ i ];
+			if( asset->bytes != NULL ) memcpy( out_bytes + asset->offset, asset->bytes, ( size_t )asset->size );
+			else pep_serialize_into( &peps[ i ], out_bytes + asset->offset, ( size_t )asset->size );
+		}
+
+		for( uint32_t i = 0; i < count; i++ )
+		{
+			const uint32_t a = ( uint32_t )order[ i * 2 + 1 ];
+			const pep* const in_pep = &peps[ a ];
+			const uint16_t palette_id = assets[ a ].palette_id;
+			uint8_t* const entry = out_bytes + PEP_PACK_HEADER_BYTES + ( size_t )i * PEP_PACK_ENTRY_BYTES;
+			_pep_put_be( entry, order[ i * 2 ], 8 );
+			_pep_put_be( entry + 8, assets[ a ].offset, 8 );
+			_pep_put_be( entry + 16, assets[ a ].size, 8 );
+			_pep_put_be( entry + 24, in_pep->width, 2 );
+			_pep_put_be( entry + 26, in_pep->height, 2 );
+			_pep_put_be( entry + 28, ( palette_id != PEP_PACK_OWN_PALETTE ) ? palettes[ palette_id ].count : ( in_pep->palette_size ? in_pep->palette_size : 256 ), 2 );
+			entry[ 30 ] = ( uint8_t )in_pep->format;
+			entry[ 31 ] = ( uint8_t )in_pep->channel_bits;
+			_pep_put_be( entry + 32, palette_id, 2 );
+			entry[ 34 ] = assets[ a ].prior;
+			entry[ 35 ] = 0;
+		}
+		*out_size = pack_size;
+	}
+
+	for( uint32_t i = 0; assets != NULL && i < count; i++ )
+	{
+		PEP_FREE( assets[ i ].bytes );
+	}
+	for( uint16_t p = 0; priors != NULL && p < palettes_count; p++ )
+	{
+		PEP_FREE( priors[ p ] );
+	}
+	if( model != NULL ) _pep_model_free( model );
+	PEP_FREE( model );
+	PEP_FREE( prior_sizes );
+	PEP_FREE( priors );
+	PEP_FREE( assets );
+	PEP_FREE( order );
+	return out_bytes;
+}
+
+// Saves a pack of count peps into a file (e.g. "sprites.pepk").
+// Returns 0 on failure, 1 on success
+static inline uint8_t pep_save_pack( const char* const* names, const pep* const peps, const uint32_t count, const pep_pack_palette* const palettes, const uint16_t palettes_count, const char* const file_path )
+{
+	if( !file_path )
+	{
+		return 0;
+	}
+
+	uint64_t bytes_size = 0;
+	uint8_t* bytes = pep_pack_build( names, peps, count, palettes, palettes_count, &bytes_size );
+
+	if( !bytes )
+	{
+		return 0;
+	}
+
+	FILE * file = fopen( file_path, "wb" );
+	if( !file )
+	{
+		PEP_FREE( bytes );
+		return 0;
+	}
+
+	size_t written = fwrite( bytes, 1, ( size_t )bytes_size, file );
+
+	fclose( file );
+	PEP_FREE( bytes );
+
+	return written == bytes_size;
+}
+
+// Opens a pack that's already in memory, which has to outlive out_pack.
+// Close it with pep_pack_close() too, it frees the models of any prior.
+// Returns 0 on failure, 1 on success
+static inline uint8_t pep_pack_open( pep_pack* const out_pack, const uint8_t* const in_bytes, const uint64_t in_bytes_size )
+{
+	if( !out_pack ) return 0;
+	memset( out_pack, 0, sizeof( pep_pack ) );
+
+	if( !in_bytes || in_bytes_size < PEP_PACK_HEADER_BYTES || memcmp( in_bytes, "PEPK", 4 ) != 0 ) return 0;
+
+	const uint32_t count = ( uint32_t )_pep_get_be( in_bytes + 4, 4 );
+	const uint32_t palettes = ( uint32_t )_pep_get_be( in_bytes + 8, 4 );
+	if( ( in_bytes_size - PEP_PACK_HEADER_BYTES ) / PEP_PACK_ENTRY_BYTES < count || palettes >= PEP_PACK_OWN_PALETTE ) return 0;
+	if( ( in_bytes_size - PEP_PACK_HEADER_BYTES - ( uint64_t )count * PEP_PACK_ENTRY_BYTES ) / 8 < palettes ) return 0;
+
+	out_pack->bytes = in_bytes;
+	out_pack->size = in_bytes_size;
+	out_pack->count = count;
+	out_pack->palettes = palettes;
+	return 1;
+}
+
+// Opens a pack file, mapping it into memory where PEP_MMAP is defined, and
+// reading all of it otherwise. Close it with pep_pack_close().
+// Returns 0 on failure, 1 on success
+static inline uint8_t pep_pack_map( pep_pack* const out_pack, const char* const file_path )
+{
+	if( !out_pack ) return 0;
+	memset( out_pack, 0, sizeof( pep_pack ) );
+	if( !file_path ) return 0;
+
+	#ifdef PEP_MMAP
+		const int file = open( file_path, O_RDONLY );
+		if( file < 0 ) return 0;
+
+		struct stat file_stat;
+		if( fstat( file, &file_stat ) != 0 || file_stat.st_size <= 0 || ( off_t )( size_t )file_stat.st_size != file_stat.st_size )
+		{
+			close( file );
+			return 0;
+		}
+
+		const size_t file_size = ( size_t )file_stat.st_size;
+		void* const mapped = mmap( NULL, file_size, PROT_READ, MAP_PRIVATE, file, 0 );
+		close( file );
+		if( mapped == MAP_FAILED ) return 0;
+
+		if( !pep_pack_open( out_pack, ( const uint8_t* )mapped, file_size ) )
+		{
+			munmap( mapped, file_size );
+			return 0;
+		}
+		out_pack->mapped = 1;
+	#else
+		FILE * file = fopen( file_path, "rb" );
+		if( !file )
+		{
+			return 0;
+		}
+
+		fseek( file, 0, SEEK_END );
+		long file_size = ftell( file );
+		fseek( file, 0, SEEK_SET );
+
+		uint8_t* bytes = ( file_size > 0 ) ? ( uint8_t* )PEP_MALLOC( file_size ) : NULL;
+		if( !bytes )
+		{
+			fclose( file );
+			return 0;
+		}
+
+		size_t read = fread( bytes, 1, file_size, file );
+		fclose( file );
+
+		if( read != ( size_t )file_size || !pep_pack_open( out_pack, bytes, ( uint64_t )read ) )
+		{
+			PEP_FREE( bytes );
+			return 0;
+		}
+		out_pack->mapped = 2;
+	#endif
+
+	return 1;
+}
+
+// Unmaps or frees what pep_pack_map() opened, every view into it included,
+// and the models pep_pack_decompress_into() kept for a prior.
+static inline void pep_pack_close( pep_pack* const pack )
+{
+	if( !pack ) return;
+
+	if( pack->models )
+	{
+		_pep_model_free( &pack->models[ 0 ] );
+		_pep_model_free( &pack->models[ 1 ] );
+	}
+	PEP_FREE( pack->models );
+
+	#ifdef PEP_MMAP
+		if( pack->mapped == 1 ) munmap( ( void* )pack->bytes, ( size_t )pack->size );
+	#endif
+	if( pack->mapped == 2 ) PEP_FREE( ( void* )pack->bytes );
+
+	memset( pack, 0, sizeof( pep_pack ) );
+}
+
+// Looks up an asset by the pep_pack_hash() of its name, in O(log n).
+// Returns 0 when it isn't in the pack, 1 when it is
+static inline uint8_t pep_pack_find_hash( const pep_pack* const pack, const uint64_t hash, pep_pack_entry* const out_entry )
+{
+	if( !pack || !pack->bytes || !out_entry ) return 0;
+
+	const uint8_t* const index = pack->bytes + PEP_PACK_HEADER_BYTES;
+	uint32_t low = 0;
+	uint32_t high = pack->count;
+	while( low < high )
+	{
+		const uint32_t middle = low + ( high - low ) / 2;
+		if( _pep_get_be( index + ( size_t )middle * PEP_PACK_ENTRY_BYTES, 8 ) < hash ) low = middle + 1;
+		else high = middle;
+	}
+
+	const uint8_t* const entry = index + ( size_t )low * PEP_PACK_ENTRY_BYTES;
+	if( low == pack->count || _pep_get_be( entry, 8 ) != hash ) return 0;
+
+	out_entry->hash = hash;
+	out_entry->offset = _pep_get_be( entry + 8, 8 );
+	out_entry->size = _pep_get_be( entry + 16, 8 );
+	out_entry->width = ( uint16_t )_pep_get_be( entry + 24, 2 );
+	out_entry->height = ( uint16_t )_pep_get_be( entry + 26, 2 );
+	out_entry->palette_count = ( uint16_t )_pep_get_be( entry + 28, 2 );
+	out_entry->format = entry[ 30 ];
+	out_entry->channel_bits = entry[ 31 ];
+	out_entry->palette_id = ( uint16_t )_pep_get_be( entry + 32, 2 );
+	out_entry->prior = entry[ 34 ];
+	return 1;
+}
+
+static inline uint8_t pep_pack_find( const pep_pack* const pack, const char* const name, pep_pack_entry* const out_entry )
+{
+	if( !name ) return 0;
+	return pep_pack_find_hash( pack, pep_pack_hash( name ), out_entry );
+}
+
+// The asset as a pep pointing into the pack, with its shared palette (and
+// the prior it was coded from, if any) looked up in the pack.
+// Returns a pep with bytes == NULL when the entry doesn't fit the pack
+static inline pep _pep_pack_view( const pep_pack* const pack, const pep_pack_entry* const entry, const uint8_t** const out_prior, uint32_t* const out_prior_size )
+{
+	pep out_pep = { 0 };
+	*out_prior = NULL;
+	*out_prior_size = 0;
+	if( !pack || !pack->bytes || !entry ) return out_pep;
+	if( entry->offset > pack->size || entry->size > pack->size - entry->offset ) return out_pep;
+
+	if( entry->palette_id == PEP_PACK_OWN_PALETTE ) return pep_deserialize_view( pack->bytes + entry->offset, entry->size );
+	if( entry->palette_id >= pack->palettes || entry->size == 0 || entry->width == 0 || entry->height == 0 ) return out_pep;
+
+	// format, count, the colors, and then the prior's size and the prior
+	const uint64_t offset = _pep_get_be( pack->bytes + PEP_PACK_HEADER_BYTES + ( size_t )pack->count * PEP_PACK_ENTRY_BYTES + ( size_t )entry->palette_id * 8, 8 );
+	if( offset > pack->size || pack->size - offset < 7 ) return out_pep;
+
+	const uint8_t* record = pack->bytes + offset;
+	const uint16_t palette_count = ( uint16_t )_pep_get_be( record + 1, 2 );
+	if( record[ 0 ] > pep_argb || record[ 0 ] != entry->format || palette_count == 0 || palette_count > 256 || palette_count != entry->palette_count ) return out_pep;
+	if( ( pack->size - offset - 7 ) / 4 < palette_count ) return out_pep;
+
+	record += 3;
+	for( uint16_t c = 0; c < palette_count; c++, record += 4 )
+	{
+		out_pep.palette[ c ] = ( uint32_t )_pep_get_be( record, 4 );
+	}
+	const uint32_t prior_size = ( uint32_t )_pep_get_be( record, 4 );
+	if( prior_size > pack->size - ( uint64_t )( record + 4 - pack->bytes ) || ( entry->prior && prior_size == 0 ) ) return out_pep;
+
+	if( entry->prior )
+	{
+		*out_prior = record + 4;
+		*out_prior_size = prior_size;
+	}
+	out_pep.bytes = ( uint8_t* )( pack->bytes + entry->offset );
+	out_pep.bytes_size = entry->size;
+	out_pep.width = entry->width;
+	out_pep.height = entry->height;
+	out_pep.format = ( pep_format )entry->format;
+	out_pep.palette_size = ( uint8_t )palette_count;
+	out_pep.channel_bits = ( pep_channel_bits )( entry->channel_bits & 0x3 );
+	return out_pep;
+}
+
+// The asset as a pep that points into the pack, ready to decompress without
+// any copy (see pep_deserialize_view()), its shared palette included. It's
+// valid until pep_pack_close(). An asset coded from a prior can only be
+// decoded with pep_pack_decompress_into(), so it comes back empty, with
+// out_needs_prior (if not NULL) set to 1 to tell it apart from a broken one.
+static inline pep pep_pack_view( const pep_pack* const pack, const pep_pack_entry* const entry, uint8_t* const out_needs_prior )
+{
+	const uint8_t* prior = NULL;
+	uint32_t prior_size = 0;
+	pep out_pep = _pep_pack_view( pack, entry, &prior, &prior_size );
+	if( out_needs_prior ) *out_needs_prior = ( prior != NULL );
+	if( prior != NULL ) memset( &out_pep, 0, sizeof( pep ) );
+	return out_pep;
+}
+
+// Decodes an asset straight out of the pack into target, like
+// pep_decompress_into(), whether it has its own palette or a shared one,
+// with or without a prior. The last prior used stays loaded on the pack, so
+// decoding assets that share it only clones its live contexts into a fresh
+// model. That makes the pack unsafe to decode from on two threads at once.
+// Returns 0 on failure, 1 on success
+static inline uint8_t pep_pack_decompress_into( pep_pack* const pack, const pep_pack_entry* const entry, const pep_target* const target )
+{
+	const uint8_t* prior = NULL;
+	uint32_t prior_size = 0;
+	const pep view = _pep_pack_view( pack, entry, &prior, &prior_size );
+	if( view.bytes == NULL || target == NULL ) return 0;
+	if( prior == NULL ) return pep_decompress_into( &view, target );
+
+	if( pack->models == NULL )
+	{
+		pack->models = ( _pep_model* )PEP_MALLOC( 2 * sizeof( _pep_model ) );
+		if( pack->models == NULL ) return 0;
+		_pep_model_init( &pack->models[ 0 ] );
+		_pep_model_init( &pack->models[ 1 ] );
+		pack->prior_palette = PEP_PACK_OWN_PALETTE;
+	}
+
+	// ( a palette's prior can't change while the pack is open, so its id is enough )
+	if( pack->prior_palette != entry->palette_id )
+	{
+		pack->prior_palette = PEP_PACK_OWN_PALETTE;
+		if( !_pep_model_load_prior( &pack->models[ 0 ], prior, prior_size ) ) return 0;
+		pack->prior_palette = entry->palette_id;
+	}
+
+	if( !_pep_model_clone( &pack->models[ 1 ], &pack->models[ 0 ] ) ) return 0;
+
+	const uint8_t scale = target->upscale ? target->upscale : 1;
+	const uint8_t rotate = ( target->orientation & pep_rotate_90 ) != 0;
+	const uint32_t out_width = ( uint32_t )( rotate ? view.height : view.width ) * scale;
+	const uint32_t out_height = ( uint32_t )( rotate ? view.width : view.height ) * scale;
+	return _pep_decompress_canvas( &view, target, out_width, out_height, 0, 0, -1, &pack->models[ 1 ] );
+}
+
 #ifdef _MSC_VER
 	#pragma warning( pop )
 #endif
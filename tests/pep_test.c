@@ -0,0 +1,886 @@
+// Regression tests for pep.h.
+//
+//	cc -O2 -o pep_test tests/pep_test.c && ./pep_test tests/data
+//
+// tests/data holds .pep files written by pep.h 0.5.1 as it was first
+// released, before any of the changes since. Every later build has to
+// decode them to exactly the same pixels. They were written by this same
+// file, built against that pep.h with PEP_TEST_WRITE_BASELINE defined:
+//
+//	cc -O2 -DPEP_TEST_HEADER='"old/pep.h"' -DPEP_TEST_WRITE_BASELINE -o write tests/pep_test.c && ./write tests/data
+
+#define PEP_IMPLEMENTATION
+#ifndef PEP_TEST_HEADER
+	#define PEP_TEST_HEADER "../pep.h"
+#endif
+#include PEP_TEST_HEADER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+	uint16_t colors;
+	uint16_t width;
+	uint16_t height;
+	uint8_t alpha; // some colors are translucent
+}
+pep_test_image;
+
+static const pep_test_image pep_test_images[] =
+{
+	{ 1, 48, 32, 0 }, { 2, 48, 32, 0 }, { 3, 48, 32, 0 }, { 4, 48, 32, 1 },
+	{ 5, 48, 32, 0 }, { 7, 48, 32, 1 }, { 12, 48, 32, 0 }, { 16, 48, 32, 0 },
+	{ 17, 48, 32, 0 }, { 33, 48, 32, 1 }, { 64, 48, 32, 0 }, { 100, 48, 32, 0 },
+	{ 200, 48, 32, 1 }, { 251, 300, 40, 0 }, { 255, 48, 32, 0 },
+};
+
+#define PEP_TEST_IMAGES ( sizeof( pep_test_images ) / sizeof( pep_test_images[ 0 ] ) )
+
+// Pixel-art-ish stripes and blocks, with every color used at least once.
+static uint32_t* pep_test_pixels( const pep_test_image* const image )
+{
+	const uint32_t area = ( uint32_t )image->width * image->height;
+	uint32_t* const pixels = ( uint32_t* )malloc( area * sizeof( uint32_t ) );
+	for( uint32_t y = 0; y < image->height; y++ )
+	{
+		for( uint32_t x = 0; x < image->width; x++ )
+		{
+			const uint32_t index = ( ( x / 3 ) * 7 + ( y / 2 ) * 13 + ( ( x * y ) >> 3 ) ) % image->colors;
+			const uint32_t i = ( y * image->width + x < image->colors ) ? y * image->width + x : index;
+			uint32_t color = ( ( i + 1 ) * 0x9e3779b1u ) & 0x00ffffff;
+			color |= ( image->alpha && ( i & 1 ) ) ? 0x80000000 : 0xff000000;
+			pixels[ y * image->width + x ] = color;
+		}
+	}
+	return pixels;
+}
+
+#ifndef PEP_TEST_WRITE_BASELINE
+// A stream reserves max_colors palette slots up front. The ones no frame
+// filled must not make an opaque stream serialize with an alpha channel.
+static int pep_test_stream_opaque( void )
+{
+	const pep_test_image image = { 12, 48, 32, 0 };
+	uint32_t* const pixels = pep_test_pixels( &image );
+
+	pep_stream stream;
+	int failures = 0;
+	if( !pep_stream_begin( &stream, image.width, image.height, pep_rgba, pep_8bit, 256, 0 ) || !pep_stream_push( &stream, pixels ) || !pep_stream_push( &stream, pixels ) )
+	{
+		printf( "FAIL stream: not recorded\n" );
+		failures++;
+	}
+	pep_animation animation = pep_stream_end( &stream );
+
+	uint32_t size = 0;
+	uint8_t* const bytes = pep_serialize( &animation.image, &size );
+	if( bytes == NULL || !( ( bytes[ 0 ] >> 5 ) & 0x1 ) )
+	{
+		printf( "FAIL stream: an opaque stream serializes with alpha\n" );
+		failures++;
+	}
+	free( bytes );
+	pep_free_animation( &animation );
+	free( pixels );
+	return failures;
+}
+
+// Decodes a pack's asset with pep_pack_decompress_into(), and checks it
+// against the pixels it was made from.
+static int pep_test_pack_decodes( pep_pack* const pack, const char* const name, const pep_test_image* const image, const uint32_t* const pixels )
+{
+	pep_pack_entry entry;
+	if( !pep_pack_find( pack, name, &entry ) || entry.width != image->width || entry.height != image->height ) return 0;
+
+	const size_t area = ( size_t )image->width * image->height;
+	uint32_t* const decoded = ( uint32_t* )calloc( area, sizeof( uint32_t ) );
+	pep_target target;
+	memset( &target, 0, sizeof( target ) );
+	target.pixels = decoded;
+	target.format = pep_rgba;
+	const int same = pep_pack_decompress_into( pack, &entry, &target ) && memcmp( decoded, pixels, area * 4 ) == 0;
+	free( decoded );
+	return same;
+}
+
+// A pack built from a few images, saved, mapped back, and every asset found
+// by name and decoded, both out of the index and through a view. Then the
+// damage pep_pack_open() and the lookups have to turn away: headers cut
+// short, entries pointing past the pack, and a shared palette's offset
+// pointing past it.
+static int pep_test_pack( void )
+{
+	static const char* const names[] = { "3.pep", "16.pep", "33.pep", "251.pep" };
+	static const uint32_t images[] = { 2, 7, 9, 13 };
+	const char* const path = "pep_test.pepk";
+	int failures = 0;
+
+	uint32_t* pixels[ 4 ];
+	pep peps[ 4 ];
+	for( uint32_t i = 0; i < 4; i++ )
+	{
+		pixels[ i ] = pep_test_pixels( &pep_test_images[ images[ i ] ] );
+		peps[ i ] = pep_compress( pixels[ i ], pep_test_images[ images[ i ] ].width, pep_test_images[ images[ i ] ].height, pep_rgba, pep_8bit );
+	}
+
+	pep_pack pack;
+	if( !pep_save_pack( names, peps, 4, NULL, 0, path ) || !pep_pack_map( &pack, path ) )
+	{
+		printf( "FAIL pack: not saved and mapped\n" );
+		failures++;
+	}
+	else
+	{
+		pep_pack_entry entry;
+		for( uint32_t i = 0; i < 4; i++ )
+		{
+			const pep_test_image* const image = &pep_test_images[ images[ i ] ];
+			if( !pep_test_pack_decodes( &pack, names[ i ], image, pixels[ i ] ) )
+			{
+				printf( "FAIL pack: %s doesn't decode\n", names[ i ] );
+				failures++;
+			}
+
+			pep view = { 0 };
+			if( pep_pack_find( &pack, names[ i ], &entry ) ) view = pep_pack_view( &pack, &entry, NULL );
+			uint32_t* const decoded = pep_decompress( &view, pep_rgba, 0, 0 );
+			if( decoded == NULL || memcmp( decoded, pixels[ i ], ( size_t )image->width * image->height * 4 ) != 0 )
+			{
+				printf( "FAIL pack: %s doesn't decode as a view\n", names[ i ] );
+				failures++;
+			}
+			free( decoded );
+		}
+		if( pep_pack_find( &pack, "missing.pep", &entry ) )
+		{
+			printf( "FAIL pack: found an asset that isn't in it\n" );
+			failures++;
+		}
+		pep_pack_close( &pack );
+	}
+	remove( path );
+
+	// the damage, on a pack in memory
+	pep_pack_palette palette;
+	memset( &palette, 0, sizeof( palette ) );
+	memcpy( palette.colors, peps[ 1 ].palette, sizeof( palette.colors ) );
+	palette.count = peps[ 1 ].palette_size ? peps[ 1 ].palette_size : 256;
+	palette.format = peps[ 1 ].format;
+
+	uint64_t size = 0;
+	uint8_t* const bytes = pep_pack_build( names, peps, 4, &palette, 1, &size );
+	uint8_t* const damaged = ( uint8_t* )malloc( ( size_t )size );
+	pep_pack_entry entry;
+	if( bytes == NULL || !pep_pack_open( &pack, bytes, size ) || !pep_pack_find( &pack, names[ 1 ], &entry ) || entry.palette_id != 0 || !pep_test_pack_decodes( &pack, names[ 1 ], &pep_test_images[ images[ 1 ] ], pixels[ 1 ] ) )
+	{
+		printf( "FAIL pack: the shared palette asset doesn't decode\n" );
+		failures++;
+	}
+	else
+	{
+		pep_pack_close( &pack );
+		for( uint64_t cut = 0; cut < PEP_PACK_HEADER_BYTES + 4 * PEP_PACK_ENTRY_BYTES + 8; cut++ )
+		{
+			if( pep_pack_open( &pack, bytes, cut ) )
+			{
+				printf( "FAIL pack: opened with only %u bytes\n", ( uint32_t )cut );
+				failures++;
+				pep_pack_close( &pack );
+			}
+		}
+		memcpy( damaged, bytes, ( size_t )size );
+		damaged[ 0 ] = 'X';
+		if( pep_pack_open( &pack, damaged, size ) )
+		{
+			printf( "FAIL pack: opened without the magic\n" );
+			failures++;
+			pep_pack_close( &pack );
+		}
+
+		// ( an entry's offset and size are at 8 and 16, a palette's offset follows the index )
+		const uint64_t offsets[] = { size, size - 1, 1, ~0ull };
+		const uint64_t sizes[] = { 1, 2, ~0ull, 1 };
+		for( uint32_t d = 0; d < 4; d++ )
+		{
+			for( uint32_t i = 0; i < 4; i++ )
+			{
+				memcpy( damaged, bytes, ( size_t )size );
+				uint8_t* const at = damaged + PEP_PACK_HEADER_BYTES + i * PEP_PACK_ENTRY_BYTES;
+				_pep_put_be( at + 8, offsets[ d ], 8 );
+				_pep_put_be( at + 16, sizes[ d ], 8 );
+
+				pep_pack_entry damaged_entry;
+				uint8_t needs_prior = 1;
+				if( !pep_pack_open( &pack, damaged, size ) || !pep_pack_find_hash( &pack, _pep_get_be( at, 8 ), &damaged_entry ) )
+				{
+					printf( "FAIL pack: a damaged entry isn't even in the index\n" );
+					failures++;
+					continue;
+				}
+				const pep view = pep_pack_view( &pack, &damaged_entry, &needs_prior );
+				pep_target target;
+				memset( &target, 0, sizeof( target ) );
+				target.pixels = damaged;
+				target.format = pep_rgba;
+				if( view.bytes != NULL || needs_prior || pep_pack_decompress_into( &pack, &damaged_entry, &target ) )
+				{
+					printf( "FAIL pack: an entry of %llu bytes at %llu was accepted\n", ( unsigned long long )sizes[ d ], ( unsigned long long )offsets[ d ] );
+					failures++;
+				}
+				pep_pack_close( &pack );
+			}
+		}
+
+		static const uint64_t palette_offsets[] = { 0, 1, 3, 6, ~0ull };
+		for( uint32_t d = 0; d < sizeof( palette_offsets ) / sizeof( palette_offsets[ 0 ] ); d++ )
+		{
+			memcpy( damaged, bytes, ( size_t )size );
+			const uint64_t offset = ( palette_offsets[ d ] == 0 || palette_offsets[ d ] == ~0ull ) ? palette_offsets[ d ] : size - palette_offsets[ d ];
+			_pep_put_be( damaged + PEP_PACK_HEADER_BYTES + 4 * PEP_PACK_ENTRY_BYTES, offset, 8 );
+			uint8_t needs_prior = 1;
+			if( !pep_pack_open( &pack, damaged, size ) ) continue;
+			const pep view = pep_pack_view( &pack, &entry, &needs_prior );
+			if( view.bytes != NULL || needs_prior )
+			{
+				printf( "FAIL pack: a palette offset of %llu was accepted\n", ( unsigned long long )offset );
+				failures++;
+			}
+			pep_pack_close( &pack );
+		}
+	}
+	free( damaged );
+	free( bytes );
+
+	for( uint32_t i = 0; i < 4; i++ )
+	{
+		pep_free( &peps[ i ] );
+		free( pixels[ i ] );
+	}
+	return failures;
+}
+
+// Two shared palettes with priors, each shared by a few images, and one
+// image with its own palette. The prior-coded assets are decoded twice with
+// the two palettes taking turns, so the prior kept loaded on the pack keeps
+// being swapped, and pep_pack_view() has to tell them apart. Then one
+// palette's prior is damaged, which only its prior-coded assets may notice.
+static int pep_test_pack_prior( void )
+{
+	static const pep_test_image images[] =
+	{
+		{ 16, 48, 32, 0 }, { 12, 48, 32, 1 }, { 16, 32, 24, 0 }, { 12, 32, 24, 1 },
+		{ 16, 40, 40, 0 }, { 12, 40, 40, 1 }, { 251, 300, 40, 0 },
+	};
+	static const char* const names[] = { "a0", "b0", "a1", "b1", "a2", "b2", "own" };
+	const uint32_t count = sizeof( images ) / sizeof( images[ 0 ] );
+	int failures = 0;
+
+	uint32_t* pixels[ sizeof( images ) / sizeof( images[ 0 ] ) ];
+	pep peps[ sizeof( images ) / sizeof( images[ 0 ] ) ];
+	pep_pack_palette palettes[ 2 ];
+	memset( palettes, 0, sizeof( palettes ) );
+	for( uint32_t i = 0; i < count; i++ )
+	{
+		pixels[ i ] = pep_test_pixels( &images[ i ] );
+		peps[ i ] = pep_compress( pixels[ i ], images[ i ].width, images[ i ].height, pep_rgba, pep_8bit );
+		if( i < 2 )
+		{
+			memcpy( palettes[ i ].colors, peps[ i ].palette, sizeof( palettes[ i ].colors ) );
+			palettes[ i ].count = peps[ i ].palette_size;
+			palettes[ i ].format = peps[ i ].format;
+			palettes[ i ].prior = 1;
+		}
+	}
+
+	uint64_t size = 0;
+	uint8_t* const bytes = pep_pack_build( names, peps, count, palettes, 2, &size );
+	pep_pack pack;
+	if( bytes == NULL || !pep_pack_open( &pack, bytes, size ) )
+	{
+		printf( "FAIL pack prior: not built\n" );
+		failures++;
+	}
+	else
+	{
+		uint32_t priors[ 2 ] = { 0, 0 };
+		for( uint32_t round = 0; round < 2; round++ )
+		{
+			for( uint32_t i = 0; i < count; i++ )
+			{
+				pep_pack_entry entry;
+				uint8_t needs_prior = 2;
+				if( !pep_pack_find( &pack, names[ i ], &entry ) ) continue;
+				const pep view = pep_pack_view( &pack, &entry, &needs_prior );
+				if( needs_prior != entry.prior || ( view.bytes == NULL ) != entry.prior )
+				{
+					printf( "FAIL pack prior: %s is viewed as if it %s a prior\n", names[ i ], needs_prior ? "needed" : "didn't need" );
+					failures++;
+				}
+				if( entry.prior && round == 0 ) priors[ entry.palette_id ]++;
+				if( !pep_test_pack_decodes( &pack, names[ i ], &images[ i ], pixels[ i ] ) )
+				{
+					printf( "FAIL pack prior: %s doesn't decode (round %u)\n", names[ i ], round );
+					failures++;
+				}
+			}
+		}
+		if( priors[ 0 ] == 0 || priors[ 1 ] == 0 )
+		{
+			printf( "FAIL pack prior: a palette has no prior-coded asset (%u and %u)\n", priors[ 0 ], priors[ 1 ] );
+			failures++;
+		}
+		pep_pack_close( &pack );
+
+		// ( a prior starts with freq_max and how many contexts follow )
+		uint8_t* const damaged = ( uint8_t* )malloc( ( size_t )size );
+		const uint64_t offset = _pep_get_be( bytes + PEP_PACK_HEADER_BYTES + count * PEP_PACK_ENTRY_BYTES, 8 );
+		uint8_t* const prior = damaged + offset + 3 + palettes[ 0 ].count * 4 + 4;
+		for( uint32_t d = 0; d < 2; d++ )
+		{
+			memcpy( damaged, bytes, ( size_t )size );
+			if( d == 0 ) _pep_put_be( prior, 0, 2 );
+			else _pep_put_be( prior + 2, _pep_get_be( prior + 2, 2 ) + 1, 2 );
+
+			pep_pack_open( &pack, damaged, size );
+			for( uint32_t round = 0; round < 2; round++ )
+			{
+				for( uint32_t i = 0; i < count; i++ )
+				{
+					pep_pack_entry entry;
+					if( !pep_pack_find( &pack, names[ i ], &entry ) ) continue;
+					const uint8_t broken = entry.prior && entry.palette_id == 0;
+					if( pep_test_pack_decodes( &pack, names[ i ], &images[ i ], pixels[ i ] ) == broken )
+					{
+						printf( "FAIL pack prior: with a damaged prior, %s %s\n", names[ i ], broken ? "still decodes" : "doesn't decode" );
+						failures++;
+					}
+				}
+			}
+			pep_pack_close( &pack );
+		}
+		free( damaged );
+	}
+	free( bytes );
+
+	for( uint32_t i = 0; i < count; i++ )
+	{
+		pep_free( &peps[ i ] );
+		free( pixels[ i ] );
+	}
+	return failures;
+}
+
+// Frames that all share one palette: a block moving over the pattern, which
+// scrolls too when scroll is set (then every frame differs everywhere).
+static uint32_t** pep_test_frames( const uint32_t frame_count, const pep_test_image* const image, const uint8_t scroll )
+{
+	uint32_t** const frames = ( uint32_t** )malloc( frame_count * sizeof( uint32_t* ) );
+	for( uint32_t f = 0; f < frame_count; f++ )
+	{
+		frames[ f ] = pep_test_pixels( image );
+		uint32_t* const pixels = frames[ f ];
+		for( uint32_t y = 0; y < image->height; y++ )
+		{
+			const uint32_t shift = scroll ? ( f * ( y / 8 + 1 ) ) % image->width : 0;
+			uint32_t row[ 4096 ];
+			memcpy( row, pixels + y * image->width, image->width * sizeof( uint32_t ) );
+			for( uint32_t x = 0; x < image->width; x++ ) pixels[ y * image->width + x ] = row[ ( x + shift ) % image->width ];
+		}
+		for( uint32_t y = f * 2; y < f * 2 + 5 && y < image->height; y++ )
+		{
+			for( uint32_t x = f * 3; x < f * 3 + 6 && x < image->width; x++ ) pixels[ y * image->width + x ] = pixels[ 0 ];
+		}
+	}
+	return frames;
+}
+
+static void pep_test_free_frames( uint32_t** const frames, const uint32_t frame_count )
+{
+	for( uint32_t f = 0; f < frame_count; f++ ) free( frames[ f ] );
+	free( frames );
+}
+
+// Plays an animation's frames in order, then seeks around it, backwards and
+// forwards and across keyframes, checking every frame it decodes.
+static int pep_test_animation_plays( const pep_animation* const animation, uint32_t* const* const frames, const pep_test_image* const image, const char* const what )
+{
+	static const uint32_t seeks[] = { 5, 2, 7, 0, 6, 3, 3, 1 };
+	const size_t area = ( size_t )image->width * image->height;
+	uint32_t* const decoded = ( uint32_t* )calloc( area, sizeof( uint32_t ) );
+	pep_target target;
+	memset( &target, 0, sizeof( target ) );
+	target.pixels = decoded;
+	target.format = pep_rgba;
+	int failures = 0;
+
+	pep_animation_player player;
+	if( !pep_animation_play( animation, &player ) )
+	{
+		printf( "FAIL %s: doesn't play\n", what );
+		free( decoded );
+		return 1;
+	}
+	for( uint32_t f = 0; f < animation->frame_count; f++ )
+	{
+		if( !pep_animation_next( &player, &target ) || memcmp( decoded, frames[ f ], area * 4 ) != 0 )
+		{
+			printf( "FAIL %s: frame %u\n", what, f );
+			failures++;
+		}
+	}
+	if( pep_animation_next( &player, &target ) )
+	{
+		printf( "FAIL %s: a frame after the last\n", what );
+		failures++;
+	}
+	for( uint32_t s = 0; s < sizeof( seeks ) / sizeof( seeks[ 0 ] ) && seeks[ s ] < animation->frame_count; s++ )
+	{
+		if( !pep_animation_seek( &player, seeks[ s ] ) || !pep_animation_next( &player, &target ) || memcmp( decoded, frames[ seeks[ s ] ], area * 4 ) != 0 )
+		{
+			printf( "FAIL %s: seeking to frame %u\n", what, seeks[ s ] );
+			failures++;
+		}
+	}
+	if( pep_animation_seek( &player, animation->frame_count ) )
+	{
+		printf( "FAIL %s: seeked past the last frame\n", what );
+		failures++;
+	}
+	pep_animation_stop( &player );
+	free( decoded );
+	return failures;
+}
+
+// Animations with and without keyframes after the first, played, seeked,
+// and played again after a serialize and deserialize. Cut short anywhere,
+// or with a frame size missing from its table, a serialized animation must
+// not deserialize.
+static int pep_test_animation( void )
+{
+	const pep_test_image image = { 12, 48, 32, 0 };
+	const uint32_t frame_count = 8;
+	uint32_t** const frames = pep_test_frames( frame_count, &image, 1 );
+	int failures = 0;
+
+	for( uint32_t keyframe_interval = 0; keyframe_interval <= 3; keyframe_interval += 3 )
+	{
+		char what[ 64 ];
+		snprintf( what, sizeof( what ), "animation, keyframes every %u", keyframe_interval );
+
+		pep_animation animation = pep_compress_animation( ( const uint32_t* const* )frames, frame_count, image.width, image.height, pep_rgba, pep_8bit, keyframe_interval );
+		if( animation.frame_count != frame_count )
+		{
+			printf( "FAIL %s: not compressed\n", what );
+			failures++;
+			continue;
+		}
+		failures += pep_test_animation_plays( &animation, frames, &image, what );
+
+		uint64_t size = 0;
+		uint8_t* const bytes = pep_serialize_animation( &animation, &size );
+		pep_animation loaded = pep_deserialize_animation( bytes, size );
+		if( loaded.frame_count != frame_count || loaded.keyframe_interval != keyframe_interval || loaded.delta != 0 )
+		{
+			printf( "FAIL %s: doesn't deserialize\n", what );
+			failures++;
+		}
+		else failures += pep_test_animation_plays( &loaded, frames, &image, what );
+		pep_free_animation( &loaded );
+
+		for( uint64_t cut = 0; bytes != NULL && cut < size; cut++ )
+		{
+			pep_animation truncated = pep_deserialize_animation( bytes, cut );
+			if( truncated.frame_count != 0 || truncated.image.bytes != NULL )
+			{
+				printf( "FAIL %s: deserialized from %u of %u bytes\n", what, ( uint32_t )cut, ( uint32_t )size );
+				failures++;
+			}
+			pep_free_animation( &truncated );
+		}
+
+		// ( the frame sizes end where the serialized image starts )
+		uint8_t varint[ 10 ];
+		const uint64_t table_end = size - pep_serialized_size( &animation.image );
+		const uint64_t last_size = _pep_write_varint( varint, animation.frame_offsets[ frame_count ] - animation.frame_offsets[ frame_count - 1 ] );
+		uint8_t* const missing = ( uint8_t* )malloc( ( size_t )size );
+		if( bytes != NULL && missing != NULL )
+		{
+			memcpy( missing, bytes, ( size_t )( table_end - last_size ) );
+			memcpy( missing + table_end - last_size, bytes + table_end, ( size_t )( size - table_end ) );
+			pep_animation truncated = pep_deserialize_animation( missing, size - last_size );
+			if( truncated.frame_count != 0 || truncated.image.bytes != NULL )
+			{
+				printf( "FAIL %s: deserialized with a frame size missing\n", what );
+				failures++;
+			}
+			pep_free_animation( &truncated );
+		}
+		free( missing );
+		free( bytes );
+		pep_free_animation( &animation );
+	}
+
+	pep_test_free_frames( frames, frame_count );
+	return failures;
+}
+
+// Delta animations, where frame 4 repeats frame 3 (so its changed region is
+// empty), played straight, seeked, and played onto a rotated and upscaled
+// target, against each frame decoded on its own. A region that reaches
+// past the frame has to stop the player instead of writing past it.
+static int pep_test_animation_delta( void )
+{
+	const pep_test_image image = { 12, 48, 32, 0 };
+	const uint32_t frame_count = 8;
+	const size_t area = ( size_t )image.width * image.height;
+	uint32_t** const frames = pep_test_frames( frame_count, &image, 0 );
+	memcpy( frames[ 4 ], frames[ 3 ], area * sizeof( uint32_t ) );
+	int failures = 0;
+
+	for( uint32_t keyframe_interval = 0; keyframe_interval <= 5; keyframe_interval += 5 )
+	{
+		char what[ 64 ];
+		snprintf( what, sizeof( what ), "delta animation, keyframes every %u", keyframe_interval );
+
+		pep_animation animation = pep_compress_animation_delta( ( const uint32_t* const* )frames, frame_count, image.width, image.height, pep_rgba, pep_8bit, keyframe_interval );
+		if( animation.frame_count != frame_count || !animation.delta || animation.frame_offsets[ 5 ] - animation.frame_offsets[ 4 ] != 4 )
+		{
+			printf( "FAIL %s: not compressed, or the unchanged frame isn't 4 empty varints\n", what );
+			failures++;
+			pep_free_animation( &animation );
+			continue;
+		}
+		failures += pep_test_animation_plays( &animation, frames, &image, what );
+
+		// ( the target is 32x48 turned, and then 2x bigger )
+		const size_t scaled = area * 4;
+		uint32_t* const decoded = ( uint32_t* )calloc( scaled, sizeof( uint32_t ) );
+		uint32_t* const expected = ( uint32_t* )calloc( scaled, sizeof( uint32_t ) );
+		pep_target target;
+		memset( &target, 0, sizeof( target ) );
+		target.format = pep_rgba;
+		target.upscale = 2;
+		target.orientation = pep_rotate_90 | pep_flip_x;
+
+		pep_animation_player player;
+		if( !pep_animation_play( &animation, &player ) )
+		{
+			printf( "FAIL %s: doesn't play\n", what );
+			failures++;
+		}
+		else
+		{
+			static const uint32_t order[] = { 0, 1, 2, 3, 4, 5, 6, 7, 2, 3, 4, 5 };
+			for( uint32_t o = 0; o < sizeof( order ) / sizeof( order[ 0 ] ); o++ )
+			{
+				const uint32_t f = order[ o ];
+				if( o > 0 && f != order[ o - 1 ] + 1 && !pep_animation_seek( &player, f ) )
+				{
+					printf( "FAIL %s: seeking to frame %u\n", what, f );
+					failures++;
+					continue;
+				}
+
+				pep single = pep_compress( frames[ f ], image.width, image.height, pep_rgba, pep_8bit );
+				target.pixels = expected;
+				const uint8_t decoded_single = pep_decompress_into( &single, &target );
+				pep_free( &single );
+				target.pixels = decoded;
+				if( !decoded_single || !pep_animation_next( &player, &target ) || memcmp( decoded, expected, scaled * 4 ) != 0 )
+				{
+					printf( "FAIL %s: frame %u, rotated and upscaled\n", what, f );
+					failures++;
+				}
+			}
+			pep_animation_stop( &player );
+		}
+		free( expected );
+		free( decoded );
+
+		// frame 1 again, behind regions that don't fit the frame
+		const uint64_t width = image.width, height = image.height;
+		const uint64_t regions[][ 4 ] =
+		{
+			{ width + 1, 0, 0, 0 }, { width - 2, 0, 3, 1 }, { 0, height, 1, 1 },
+			{ 0, 0, width, height + 1 }, { 0, 0, 1ull << 40, 1 }, { 1, 1, ~0ull, ~0ull },
+		};
+		const uint8_t* frame_ref = animation.image.bytes + animation.frame_offsets[ 1 ];
+		const uint8_t* const frame_end = animation.image.bytes + animation.frame_offsets[ 2 ];
+		uint64_t region[ 4 ];
+		for( uint8_t i = 0; i < 4; i++ ) _pep_read_varint( &frame_ref, frame_end, &region[ i ] );
+		const uint64_t rest = ( uint64_t )( frame_end - frame_ref );
+
+		for( uint32_t r = 0; r < sizeof( regions ) / sizeof( regions[ 0 ] ); r++ )
+		{
+			pep_animation damaged = animation;
+			uint64_t frame_offsets[ 3 ];
+			damaged.frame_count = 2;
+			damaged.frame_offsets = frame_offsets;
+			damaged.image.bytes = ( uint8_t* )malloc( ( size_t )( animation.frame_offsets[ 1 ] + 4 * 10 + rest ) );
+			memcpy( damaged.image.bytes, animation.image.bytes, ( size_t )animation.frame_offsets[ 1 ] );
+			uint8_t* out_ref = damaged.image.bytes + animation.frame_offsets[ 1 ];
+			for( uint8_t i = 0; i < 4; i++ ) out_ref += _pep_write_varint( out_ref, regions[ r ][ i ] );
+			memcpy( out_ref, frame_ref, ( size_t )rest );
+			frame_offsets[ 0 ] = 0;
+			frame_offsets[ 1 ] = animation.frame_offsets[ 1 ];
+			frame_offsets[ 2 ] = ( uint64_t )( out_ref - damaged.image.bytes ) + rest;
+			damaged.image.bytes_size = frame_offsets[ 2 ];
+
+			uint32_t* const pixels = ( uint32_t* )calloc( area, sizeof( uint32_t ) );
+			target.pixels = pixels;
+			target.upscale = 0;
+			target.orientation = 0;
+			if( !pep_animation_play( &damaged, &player ) || !pep_animation_next( &player, &target ) || pep_animation_next( &player, &target ) )
+			{
+				printf( "FAIL %s: region { %llu, %llu, %llu, %llu } was played\n", what, ( unsigned long long )regions[ r ][ 0 ], ( unsigned long long )regions[ r ][ 1 ], ( unsigned long long )regions[ r ][ 2 ], ( unsigned long long )regions[ r ][ 3 ] );
+				failures++;
+			}
+			pep_animation_stop( &player );
+			free( pixels );
+			free( damaged.image.bytes );
+		}
+		pep_free_animation( &animation );
+	}
+
+	pep_test_free_frames( frames, frame_count );
+	return failures;
+}
+
+// One RGBA pixel (as pep_decompress() gives it) in format, written out the
+// way pep_format documents the smaller formats.
+static uint32_t pep_test_format_pixel( const uint32_t rgba, const pep_format format, uint8_t out[ 4 ] )
+{
+	const uint32_t r = rgba & 0xff, g = ( rgba >> 8 ) & 0xff, b = ( rgba >> 16 ) & 0xff, a = rgba >> 24;
+	uint16_t packed = 0;
+	switch( format )
+	{
+		case pep_rgb565: packed = ( uint16_t )( ( ( r >> 3 ) << 11 ) | ( ( g >> 2 ) << 5 ) | ( b >> 3 ) ); memcpy( out, &packed, 2 ); return 2;
+		case pep_rgba5551: packed = ( uint16_t )( ( ( r >> 3 ) << 11 ) | ( ( g >> 3 ) << 6 ) | ( ( b >> 3 ) << 1 ) | ( a >> 7 ) ); memcpy( out, &packed, 2 ); return 2;
+		case pep_rgba4444: packed = ( uint16_t )( ( ( r >> 4 ) << 12 ) | ( ( g >> 4 ) << 8 ) | ( ( b >> 4 ) << 4 ) | ( a >> 4 ) ); memcpy( out, &packed, 2 ); return 2;
+		case pep_rgb24: out[ 0 ] = ( uint8_t )r; out[ 1 ] = ( uint8_t )g; out[ 2 ] = ( uint8_t )b; return 3;
+		case pep_bgr24: out[ 0 ] = ( uint8_t )b; out[ 1 ] = ( uint8_t )g; out[ 2 ] = ( uint8_t )r; return 3;
+		case pep_l8: out[ 0 ] = ( uint8_t )( ( 77 * r + 150 * g + 29 * b + 128 ) >> 8 ); return 1;
+		case pep_a8: out[ 0 ] = ( uint8_t )a; return 1;
+		default: break;
+	}
+	const uint32_t color = _pep_reformat( rgba, pep_rgba, format );
+	memcpy( out, &color, 4 );
+	return 4;
+}
+
+// The other decode paths, each against what pep_decompress() gives: every
+// output format (through a padded stride), all 8 orientations with and
+// without upscaling, compositing onto a smaller surface past each of its
+// edges (with and without the color-key), and a replaced palette and remap.
+static int pep_test_decode_paths_of( const pep_test_image* const image )
+{
+	const uint32_t width = image->width, height = image->height;
+	uint32_t* const pixels = pep_test_pixels( image );
+	pep compressed = pep_compress( pixels, image->width, image->height, pep_rgba, pep_8bit );
+	uint32_t* const reference = pep_decompress( &compressed, pep_rgba, 0, 0 );
+	const uint16_t palette_count = compressed.palette_size ? compressed.palette_size : 256;
+	uint8_t* const out = ( uint8_t* )malloc( ( size_t )width * height * 9 * 4 + 64 * 4 );
+	int failures = 0;
+	if( reference == NULL || out == NULL ) return 1;
+
+	pep_target target;
+	for( uint32_t format = pep_rgba; format <= pep_a8; format++ )
+	{
+		memset( &target, 0, sizeof( target ) );
+		const uint8_t bytes_per_pixel = pep_bytes_per_pixel( ( pep_format )format );
+		target.pixels = out;
+		target.format = ( pep_format )format;
+		target.stride = width * bytes_per_pixel + 5;
+		uint32_t wrong = !pep_decompress_into( &compressed, &target );
+		for( uint32_t i = 0; !wrong && i < width * height; i++ )
+		{
+			uint8_t expected[ 4 ];
+			pep_test_format_pixel( reference[ i ], ( pep_format )format, expected );
+			wrong = memcmp( out + ( i / width ) * target.stride + ( i % width ) * bytes_per_pixel, expected, bytes_per_pixel ) != 0;
+		}
+		if( wrong )
+		{
+			printf( "FAIL decode paths, %u colors: format %u\n", image->colors, format );
+			failures++;
+		}
+	}
+
+	// ( rotated clockwise first, then flipped, so output ( x, y ) maps back to the source )
+	for( uint32_t orientation = 0; orientation < 8; orientation++ )
+	{
+		for( uint8_t scale = 1; scale <= 3; scale += 2 )
+		{
+			memset( &target, 0, sizeof( target ) );
+			target.pixels = out;
+			target.format = pep_rgba;
+			target.orientation = ( uint8_t )orientation;
+			target.upscale = scale;
+			const uint8_t rotate = ( orientation & pep_rotate_90 ) != 0;
+			const uint32_t oriented_width = rotate ? height : width, oriented_height = rotate ? width : height;
+			uint32_t wrong = !pep_decompress_into( &compressed, &target );
+			for( uint32_t y = 0; !wrong && y < oriented_height * scale; y++ )
+			{
+				for( uint32_t x = 0; !wrong && x < oriented_width * scale; x++ )
+				{
+					uint32_t ox = x / scale, oy = y / scale;
+					if( orientation & pep_flip_x ) ox = oriented_width - 1 - ox;
+					if( orientation & pep_flip_y ) oy = oriented_height - 1 - oy;
+					const uint32_t sx = rotate ? oy : ox, sy = rotate ? height - 1 - ox : oy;
+					uint32_t pixel;
+					memcpy( &pixel, out + ( ( size_t )y * oriented_width * scale + x ) * 4, 4 );
+					wrong = pixel != reference[ sy * width + sx ];
+				}
+			}
+			if( wrong )
+			{
+				printf( "FAIL decode paths, %u colors: orientation %u, upscale %u\n", image->colors, orientation, scale );
+				failures++;
+			}
+		}
+	}
+
+	// ( a 40x24 surface, the image hanging past its left and top, then its right and bottom )
+	static const int32_t places[][ 3 ] = { { -10, -7, 1 }, { 20, 15, 1 }, { -61, 3, 2 }, { 25, -40, 2 }, { 40, 0, 1 }, { -48, 0, 1 } };
+	const uint32_t surface_width = 40, surface_height = 24;
+	for( uint32_t p = 0; p < sizeof( places ) / sizeof( places[ 0 ] ); p++ )
+	{
+		for( uint8_t key = 0; key < 2; key++ )
+		{
+			memset( &target, 0, sizeof( target ) );
+			target.pixels = out;
+			target.format = pep_rgba;
+			target.upscale = ( uint8_t )places[ p ][ 2 ];
+			target.transparent_first_color = key;
+			for( uint32_t i = 0; i < surface_width * ( surface_height + 2 ); i++ ) memcpy( out + i * 4, "\x12\x34\x56\x78", 4 );
+			uint32_t wrong = !pep_decompress_onto( &compressed, &target, surface_width, surface_height, places[ p ][ 0 ], places[ p ][ 1 ] );
+			// ( the 2 rows past the surface must stay untouched too )
+			for( uint32_t i = 0; !wrong && i < surface_width * ( surface_height + 2 ); i++ )
+			{
+				const int64_t sx = ( int64_t )( i % surface_width ) - places[ p ][ 0 ], sy = ( int64_t )( i / surface_width ) - places[ p ][ 1 ];
+				uint32_t expected;
+				memcpy( &expected, "\x12\x34\x56\x78", 4 );
+				if( sx >= 0 && sy >= 0 && i < surface_width * surface_height && sx < width * places[ p ][ 2 ] && sy < height * places[ p ][ 2 ] )
+				{
+					const uint32_t pixel = reference[ ( sy / places[ p ][ 2 ] ) * width + sx / places[ p ][ 2 ] ];
+					if( !key || pixel != compressed.palette[ 0 ] ) expected = pixel;
+				}
+				uint32_t pixel;
+				memcpy( &pixel, out + i * 4, 4 );
+				wrong = pixel != expected;
+			}
+			if( wrong )
+			{
+				printf( "FAIL decode paths, %u colors: onto ( %d, %d ), upscale %d, %s\n", image->colors, places[ p ][ 0 ], places[ p ][ 1 ], places[ p ][ 2 ], key ? "keyed" : "not keyed" );
+				failures++;
+			}
+		}
+	}
+
+	// ( the palette reversed, the indices shuffled, and both )
+	uint32_t palette[ 256 ];
+	uint8_t remap[ 256 ];
+	for( uint16_t i = 0; i < palette_count; i++ )
+	{
+		palette[ i ] = compressed.palette[ palette_count - 1 - i ];
+		remap[ i ] = ( uint8_t )( ( i * 5 + 1 ) % palette_count );
+	}
+	for( uint8_t recolor = 1; recolor < 4; recolor++ )
+	{
+		const uint32_t* const colors = ( recolor & 1 ) ? palette : compressed.palette;
+		uint32_t* const recolored = pep_decompress_recolored( &compressed, pep_rgba, 0, 0, ( recolor & 1 ) ? palette : NULL, ( recolor & 2 ) ? remap : NULL );
+		uint32_t wrong = recolored == NULL;
+		for( uint32_t i = 0; !wrong && i < width * height; i++ )
+		{
+			uint16_t index = 0;
+			while( compressed.palette[ index ] != reference[ i ] ) index++;
+			wrong = recolored[ i ] != colors[ ( recolor & 2 ) ? remap[ index ] : index ];
+		}
+		if( wrong )
+		{
+			static const char* const recolors[ 4 ] = { "", "a palette", "a remap", "a palette and a remap" };
+			printf( "FAIL decode paths, %u colors: recolored with %s\n", image->colors, recolors[ recolor ] );
+			failures++;
+		}
+		free( recolored );
+	}
+
+	free( out );
+	free( reference );
+	pep_free( &compressed );
+	free( pixels );
+	return failures;
+}
+
+static int pep_test_decode_paths( void )
+{
+	// ( few colors pack several indices per byte and give long color-key runs )
+	static const pep_test_image images[ 2 ] = { { 5, 48, 32, 1 }, { 33, 48, 32, 1 } };
+	int failures = 0;
+	for( uint32_t i = 0; i < 2; i++ ) failures += pep_test_decode_paths_of( &images[ i ] );
+	return failures;
+}
+#endif
+
+int main( int argc, char** argv )
+{
+	const char* const directory = ( argc > 1 ) ? argv[ 1 ] : "tests/data";
+	int failures = 0;
+
+	for( uint32_t t = 0; t < PEP_TEST_IMAGES; t++ )
+	{
+		const pep_test_image* const image = &pep_test_images[ t ];
+		uint32_t* const pixels = pep_test_pixels( image );
+		const size_t area = ( size_t )image->width * image->height;
+
+		char path[ 1024 ];
+		snprintf( path, sizeof( path ), "%s/baseline_%u.pep", directory, image->colors );
+
+		#ifdef PEP_TEST_WRITE_BASELINE
+			pep written = pep_compress( pixels, image->width, image->height, pep_rgba, pep_8bit );
+			if( !pep_save( &written, path ) )
+			{
+				printf( "FAIL %s: not written\n", path );
+				failures++;
+			}
+			pep_free( &written );
+		#else
+			// the stored file
+			pep loaded = pep_load( path );
+			uint32_t* decoded = pep_decompress( &loaded, pep_rgba, 0, 0 );
+			if( decoded == NULL || loaded.width != image->width || loaded.height != image->height || memcmp( decoded, pixels, area * 4 ) != 0 )
+			{
+				printf( "FAIL %s: doesn't decode to the original pixels\n", path );
+				failures++;
+			}
+			free( decoded );
+			pep_free( &loaded );
+
+			// a round-trip through this build
+			pep compressed = pep_compress( pixels, image->width, image->height, pep_rgba, pep_8bit );
+			decoded = pep_decompress( &compressed, pep_rgba, 0, 0 );
+			if( decoded == NULL || memcmp( decoded, pixels, area * 4 ) != 0 )
+			{
+				printf( "FAIL %u colors: round-trip\n", image->colors );
+				failures++;
+			}
+			free( decoded );
+			pep_free( &compressed );
+		#endif
+
+		free( pixels );
+	}
+
+	#ifndef PEP_TEST_WRITE_BASELINE
+		failures += pep_test_stream_opaque();
+		failures += pep_test_pack();
+		failures += pep_test_pack_prior();
+		failures += pep_test_animation();
+		failures += pep_test_animation_delta();
+		failures += pep_test_decode_paths();
+	#endif
+
+	printf( failures ? "%d FAILED\n" : "all passed\n", failures );
+	return failures != 0;
+}